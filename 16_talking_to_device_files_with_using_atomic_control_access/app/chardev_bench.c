@@ -0,0 +1,267 @@
+/*
+ * chardev_bench.c - throughput and latency of the chardev module's write,
+ * read and ioctl paths, swept over message sizes and thread counts.
+ *
+ * All threads share one file descriptor, so it also works with the module
+ * loaded with exclusive=1. Reads and writes use pread()/pwrite() at offset 0,
+ * so every write replaces the whole message and every read returns it.
+ * IOCTL_SET_MSG is limited to 1023 byte messages by the driver and is
+ * skipped for larger sizes.
+ *
+ * Output is CSV, one line per operation, size and thread count.
+ *
+ * Build: gcc -O2 -pthread -o chardev_bench chardev_bench.c
+ * Usage: ./chardev_bench [seconds_per_point] [max_threads] [max_size]
+ */
+
+#include "../chardev.h"
+#include <stdio.h>     /* standard I/O */
+#include <fcntl.h>     /* open */
+#include <unistd.h>    /* close, pread, pwrite */
+#include <stdlib.h>    /* exit, strtoul */
+#include <string.h>    /* memset */
+#include <time.h>      /* clock_gettime */
+#include <pthread.h>   /* pthread_create */
+#include <sys/ioctl.h> /* ioctl */
+
+#define SET_MSG_MAX 1023
+
+/* Latency histogram: exact below 16 ns, then 16 buckets per power of two,
+ * so percentiles are within about 6% without storing every sample.
+ */
+#define LAT_SUB 16
+#define LAT_BUCKETS (64 * LAT_SUB)
+
+enum op
+{
+    OP_WRITE,
+    OP_READ,
+    OP_SET_MSG,
+    OP_GET_MSG,
+    OP_GET_NTH_BYTE,
+    OP_COUNT,
+};
+
+static const char *const op_names[OP_COUNT] = {
+    "write", "read", "ioctl_set_msg", "ioctl_get_msg", "ioctl_get_nth_byte",
+};
+
+static const size_t sizes[] = {16, 256, 1000, 4096, 65536, 1 << 20, 16 << 20};
+
+struct worker
+{
+    pthread_t thread;
+    int fd;
+    enum op op;
+    size_t size;
+    unsigned long long deadline;
+    char *buf;
+    unsigned long ops;
+    unsigned long lat[LAT_BUCKETS];
+    int failed;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int lat_bucket(unsigned long long ns)
+{
+    unsigned int e;
+
+    if (ns < LAT_SUB)
+        return ns;
+    e = 63 - __builtin_clzll(ns);
+    return (e - 3) * LAT_SUB + ((ns >> (e - 4)) & (LAT_SUB - 1));
+}
+
+/* Lowest latency in ns that falls into bucket b */
+static unsigned long long lat_value(unsigned int b)
+{
+    if (b < LAT_SUB)
+        return b;
+    return (unsigned long long)(LAT_SUB + b % LAT_SUB) << (b / LAT_SUB - 1);
+}
+
+/* Latency in us below which fraction q of the n samples in lat fall */
+static double lat_percentile(const unsigned long *lat, unsigned long n, double q)
+{
+    unsigned long rank = (unsigned long)(q * n), seen = 0;
+    unsigned int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++)
+    {
+        seen += lat[b];
+        if (seen > rank)
+            break;
+    }
+    return lat_value(b < LAT_BUCKETS ? b : LAT_BUCKETS - 1) / 1e3;
+}
+
+/* One operation of the kind being measured; returns bytes moved or -1 */
+static ssize_t do_op(struct worker *w, unsigned int *seed)
+{
+    switch (w->op)
+    {
+    case OP_WRITE:
+        return pwrite(w->fd, w->buf, w->size, 0);
+    case OP_READ:
+        return pread(w->fd, w->buf, w->size, 0);
+    case OP_SET_MSG:
+        return ioctl(w->fd, IOCTL_SET_MSG, w->buf) < 0 ? -1 : (ssize_t)w->size;
+    case OP_GET_MSG:
+        return ioctl(w->fd, IOCTL_GET_MSG, w->buf) < 0 ? -1 : (ssize_t)w->size + 1;
+    case OP_GET_NTH_BYTE:
+        *seed = *seed * 1103515245u + 12345u;
+        return ioctl(w->fd, IOCTL_GET_NTH_BYTE, (*seed >> 8) % w->size) < 0 ? -1 : 1;
+    default:
+        return -1;
+    }
+}
+
+static void *worker_loop(void *arg)
+{
+    struct worker *w = arg;
+    unsigned int seed = (unsigned int)(unsigned long)w;
+    unsigned long long t0, t1;
+
+    t0 = now_ns();
+    while (t0 < w->deadline)
+    {
+        if (do_op(w, &seed) < 0)
+        {
+            perror(op_names[w->op]);
+            w->failed = 1;
+            break;
+        }
+        t1 = now_ns();
+        w->lat[lat_bucket(t1 - t0)]++;
+        w->ops++;
+        t0 = t1;
+    }
+    return NULL;
+}
+
+/* Publish a message of size bytes for the read side operations */
+static int set_message(int fd, size_t size)
+{
+    char *msg = malloc(size);
+    ssize_t ret;
+
+    if (!msg)
+        return -1;
+    memset(msg, 'x', size);
+    ret = pwrite(fd, msg, size, 0);
+    free(msg);
+    return ret == (ssize_t)size ? 0 : -1;
+}
+
+static int run_point(int fd, enum op op, size_t size, int threads, double seconds)
+{
+    struct worker *w = calloc(threads, sizeof(*w));
+    static unsigned long lat[LAT_BUCKETS];
+    unsigned long long start;
+    unsigned long ops = 0;
+    int i, b, started, ret = 0;
+    double elapsed, bytes;
+
+    if (!w)
+        return -1;
+
+    if ((op == OP_READ || op == OP_GET_MSG || op == OP_GET_NTH_BYTE) && set_message(fd, size) < 0)
+    {
+        perror("set message");
+        free(w);
+        return -1;
+    }
+
+    start = now_ns();
+    for (i = 0; i < threads; i++)
+    {
+        w[i].fd = fd;
+        w[i].op = op;
+        w[i].size = size;
+        w[i].deadline = start + (unsigned long long)(seconds * 1e9);
+        w[i].buf = malloc(size + 1);
+        if (!w[i].buf)
+        {
+            fprintf(stderr, "out of memory\n");
+            ret = -1;
+            break;
+        }
+        memset(w[i].buf, 'y', size);
+        w[i].buf[size] = '\0'; /* IOCTL_SET_MSG takes a string */
+    }
+
+    for (started = 0; started < threads && !ret; started++)
+    {
+        if (pthread_create(&w[started].thread, NULL, worker_loop, &w[started]))
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            ret = -1;
+            break;
+        }
+    }
+
+    memset(lat, 0, sizeof(lat));
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(w[i].thread, NULL);
+        ops += w[i].ops;
+        for (b = 0; b < LAT_BUCKETS; b++)
+            lat[b] += w[i].lat[b];
+        ret |= w[i].failed ? -1 : 0;
+    }
+    elapsed = (now_ns() - start) / 1e9;
+
+    if (ops)
+    {
+        bytes = op == OP_GET_NTH_BYTE ? ops : (double)ops * (size + (op == OP_GET_MSG));
+        printf("%s,%zu,%d,%lu,%.0f,%.2f,%.2f,%.2f,%.2f\n", op_names[op], size, started, ops,
+               ops / elapsed, bytes / elapsed / 1e6, lat_percentile(lat, ops, 0.5),
+               lat_percentile(lat, ops, 0.99), lat_percentile(lat, ops, 0.999));
+        fflush(stdout);
+    }
+
+    for (i = 0; i < threads; i++)
+        free(w[i].buf);
+    free(w);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? strtod(argv[1], NULL) : 1.0;
+    int max_threads = argc > 2 ? (int)strtoul(argv[2], NULL, 0) : 8;
+    size_t max_size = argc > 3 ? strtoul(argv[3], NULL, 0) : 1 << 20;
+    int file_desc, threads, ret = 0;
+    enum op op;
+    size_t s;
+
+    file_desc = open(DEVICE_PATH, O_RDWR);
+    if (file_desc < 0)
+    {
+        perror("Can't open device file");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("op,size,threads,ops,ops_per_s,mb_per_s,p50_us,p99_us,p999_us\n");
+
+    for (op = 0; op < OP_COUNT; op++)
+    {
+        for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && sizes[s] <= max_size; s++)
+        {
+            if (op == OP_SET_MSG && sizes[s] > SET_MSG_MAX)
+                continue;
+            for (threads = 1; threads <= max_threads; threads *= 2)
+                ret |= run_point(file_desc, op, sizes[s], threads, seconds);
+        }
+    }
+
+    close(file_desc);
+    return ret ? EXIT_FAILURE : 0;
+}
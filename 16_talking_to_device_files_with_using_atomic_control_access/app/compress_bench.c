@@ -0,0 +1,239 @@
+/*
+ * compress_bench.c - store a log-like text message in the chardev module with
+ * and without LZ4 compression and compare memory held against read speed.
+ *
+ * Compression is selected with the compress module parameter. When run as
+ * root the benchmark switches it itself and measures both; otherwise it
+ * measures whatever the module is currently configured for. Every run also
+ * reads the whole message back once and checks it. The message is written
+ * with a single write(), so a plain message is held in a buffer of its own
+ * size rather than in one grown by appends.
+ *
+ * Build: gcc -O2 -o compress_bench compress_bench.c
+ * Usage: ./compress_bench [message_mb] [range_bytes] [ranged_reads]
+ */
+
+#include "../chardev.h"
+#include <stdio.h>     /* standard I/O */
+#include <fcntl.h>     /* open */
+#include <unistd.h>    /* close, pread, write */
+#include <stdlib.h>    /* exit, strtoul, malloc */
+#include <string.h>    /* memcmp */
+#include <time.h>      /* clock_gettime */
+#include <sys/ioctl.h> /* ioctl */
+
+#define COMPRESS_PARAM "/sys/module/chardev/parameters/compress"
+#define SEQ_PASSES 4
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns 0 if the parameter could be written */
+static int set_compress(int on)
+{
+    FILE *f = fopen(COMPRESS_PARAM, "w");
+    int ret;
+
+    if (!f)
+        return -1;
+    ret = fprintf(f, "%c\n", on ? 'Y' : 'N') < 0 ? -1 : 0;
+    if (fclose(f))
+        ret = -1;
+    return ret;
+}
+
+static int get_compress(void)
+{
+    FILE *f = fopen(COMPRESS_PARAM, "r");
+    int c;
+
+    if (!f)
+        return -1;
+    c = fgetc(f);
+    fclose(f);
+    return c == 'Y';
+}
+
+/* Service log lines: repetitive, but not trivially so */
+static void fill_text(char *text, size_t size)
+{
+    static const char *const levels[] = {"INFO", "INFO", "INFO", "WARN", "DEBUG"};
+    unsigned int x = 2463534242u;
+    size_t done = 0;
+    char line[160];
+
+    while (done < size)
+    {
+        int len;
+
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        len = snprintf(line, sizeof(line),
+                       "2026-10-18T12:%02u:%02u.%03uZ %s worker-%u handled GET /api/v1/items/%u "
+                       "status=200 bytes=%u\n",
+                       x % 60, (x >> 6) % 60, (x >> 12) % 1000, levels[x % 5], (x >> 3) % 16,
+                       x % 100000, (x >> 8) % 65536);
+        if ((size_t)len > size - done)
+            len = size - done;
+        memcpy(text + done, line, len);
+        done += len;
+    }
+}
+
+static int write_message(int fd, const char *text, size_t size)
+{
+    size_t done = 0;
+
+    /* A short write leaves the rest to be appended */
+    while (done < size)
+    {
+        ssize_t ret = write(fd, text + done, size - done);
+
+        if (ret < 0)
+        {
+            perror("write failed");
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+static int read_range(int fd, char *buf, size_t pos, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len)
+    {
+        ssize_t ret = pread(fd, buf + done, len - done, pos + done);
+
+        if (ret <= 0)
+        {
+            perror("read failed");
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+static int run(const char *mode, const char *text, size_t size, size_t range,
+               unsigned long reads)
+{
+    struct chardev_msg_stat stat;
+    unsigned int x = 88675123u;
+    double t0, t_seq, t_range;
+    unsigned long i;
+    char *buf;
+    int fd, pass;
+
+    buf = malloc(size);
+    if (!buf)
+    {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+
+    fd = open(DEVICE_PATH, O_RDWR);
+    if (fd < 0)
+    {
+        perror("Can't open device file");
+        free(buf);
+        return -1;
+    }
+
+    if (write_message(fd, text, size) < 0)
+        goto error;
+
+    if (ioctl(fd, IOCTL_GET_MSG_STAT, &stat) < 0)
+    {
+        perror("ioctl_get_msg_stat failed");
+        goto error;
+    }
+
+    if (read_range(fd, buf, 0, size) < 0)
+        goto error;
+    if (memcmp(buf, text, size))
+    {
+        fprintf(stderr, "%s: message read back differs\n", mode);
+        goto error;
+    }
+
+    t0 = now_sec();
+    for (pass = 0; pass < SEQ_PASSES; pass++)
+        if (read_range(fd, buf, 0, size) < 0)
+            goto error;
+    t_seq = now_sec() - t0;
+
+    t0 = now_sec();
+    for (i = 0; i < reads; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        if (read_range(fd, buf, x % (size - range + 1), range) < 0)
+            goto error;
+    }
+    t_range = now_sec() - t0;
+
+    printf("%s,%zu,%.2f,%.2f,%u,%.2f,%.2f\n", mode, size >> 20, stat.stored / 1048576.0,
+           (double)stat.size / stat.stored, stat.chunk_bytes,
+           SEQ_PASSES * size / t_seq / 1e9, t_range * 1e6 / reads);
+
+    close(fd);
+    free(buf);
+    return 0;
+
+error:
+    close(fd);
+    free(buf);
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size = (argc > 1 ? strtoul(argv[1], NULL, 0) : 16) << 20;
+    size_t range = argc > 2 ? strtoul(argv[2], NULL, 0) : 4096;
+    unsigned long reads = argc > 3 ? strtoul(argv[3], NULL, 0) : 100000;
+    int old, ret = 0;
+    char *text;
+
+    if (range == 0 || range > size)
+    {
+        fprintf(stderr, "range_bytes must be between 1 and the message size\n");
+        exit(EXIT_FAILURE);
+    }
+
+    text = malloc(size);
+    if (!text)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    fill_text(text, size);
+
+    printf("mode,message_mb,stored_mb,ratio,chunk_bytes,seq_gb_per_s,range_read_us\n");
+
+    old = get_compress();
+    if (old >= 0 && set_compress(0) == 0)
+    {
+        ret |= run("plain", text, size, range, reads);
+        set_compress(1);
+        ret |= run("lz4", text, size, range, reads);
+        set_compress(old);
+    }
+    else
+    {
+        fprintf(stderr, "can't change %s, measuring current setting only\n", COMPRESS_PARAM);
+        ret = run(old > 0 ? "lz4" : "plain", text, size, range, reads);
+    }
+
+    free(text);
+    return ret ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,252 @@
+/*
+ * mmap_scan_bench.c - scan a large chardev message through mmap() with
+ * PMD sized (2 MB on x86) and base page backing and compare sequential and
+ * random read speed.
+ *
+ * The backing is selected with the large_msg_order module parameter. When
+ * run as root the benchmark switches it itself and measures both; otherwise
+ * it measures whatever the module is currently configured for. The PMD order
+ * comes from the transparent hugepage sysfs files; without them the huge run
+ * uses the module's current order. max_message_bytes is raised for the run
+ * if the message wouldn't fit.
+ *
+ * Build: gcc -O2 -o mmap_scan_bench mmap_scan_bench.c
+ * Usage: ./mmap_scan_bench [message_mb] [random_loads]
+ */
+
+#include "../chardev.h"
+#include <stdio.h>     /* standard I/O */
+#include <errno.h>     /* errno */
+#include <fcntl.h>     /* open */
+#include <unistd.h>    /* close, write */
+#include <stdlib.h>    /* exit, strtoul */
+#include <string.h>    /* memset */
+#include <time.h>      /* clock_gettime */
+#include <sys/mman.h>  /* mmap */
+
+#define ORDER_PARAM "/sys/module/chardev/parameters/large_msg_order"
+#define CAP_PARAM "/sys/module/chardev/parameters/max_message_bytes"
+#define PMD_SIZE_FILE "/sys/kernel/mm/transparent_hugepage/hpage_pmd_size"
+#define WRITE_CHUNK (1 << 20)
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns 0 if the parameter could be written */
+static int set_order(unsigned int order)
+{
+    FILE *f = fopen(ORDER_PARAM, "w");
+    int ret;
+
+    if (!f)
+        return -1;
+    ret = fprintf(f, "%u\n", order) < 0 ? -1 : 0;
+    if (fclose(f))
+        ret = -1;
+    return ret;
+}
+
+static int get_order(void)
+{
+    FILE *f = fopen(ORDER_PARAM, "r");
+    unsigned int order;
+    int ret;
+
+    if (!f)
+        return -1;
+    ret = fscanf(f, "%u", &order) == 1 ? (int)order : -1;
+    fclose(f);
+    return ret;
+}
+
+/* Page order of a PMD mapping, or -1 if the kernel doesn't say */
+static int pmd_order(void)
+{
+    FILE *f = fopen(PMD_SIZE_FILE, "r");
+    unsigned long pmd, page = sysconf(_SC_PAGESIZE);
+    int order = -1;
+
+    if (!f)
+        return -1;
+    if (fscanf(f, "%lu", &pmd) == 1 && pmd >= page)
+        for (order = 0; (page << order) < pmd; order++)
+            ;
+    fclose(f);
+    return order;
+}
+
+/* Returns 0 if the parameter could be written */
+static int set_cap(unsigned long bytes)
+{
+    FILE *f = fopen(CAP_PARAM, "w");
+    int ret;
+
+    if (!f)
+        return -1;
+    ret = fprintf(f, "%lu\n", bytes) < 0 ? -1 : 0;
+    if (fclose(f))
+        ret = -1;
+    return ret;
+}
+
+static int get_cap(unsigned long *bytes)
+{
+    FILE *f = fopen(CAP_PARAM, "r");
+    int ret;
+
+    if (!f)
+        return -1;
+    ret = fscanf(f, "%lu", bytes) == 1 ? 0 : -1;
+    fclose(f);
+    return ret;
+}
+
+/* Name of the backing for a large_msg_order, such as "2M" or "4K" */
+static const char *backing_name(int order, char *buf, size_t len)
+{
+    unsigned long bytes = (unsigned long)sysconf(_SC_PAGESIZE) << order;
+
+    if (order < 0)
+        snprintf(buf, len, "current");
+    else if (bytes >= 1 << 20)
+        snprintf(buf, len, "%luM", bytes >> 20);
+    else
+        snprintf(buf, len, "%luK", bytes >> 10);
+    return buf;
+}
+
+/* Publish a message of size bytes: consecutive writes on a fresh fd append */
+static int write_message(int fd, size_t size)
+{
+    static char chunk[WRITE_CHUNK];
+    size_t done = 0;
+
+    memset(chunk, 'x', sizeof(chunk));
+    while (done < size)
+    {
+        size_t len = size - done < sizeof(chunk) ? size - done : sizeof(chunk);
+        ssize_t ret = write(fd, chunk, len);
+
+        if (ret < 0)
+        {
+            if (errno == ENOSPC)
+                fprintf(stderr, "a %zu MiB message doesn't fit in max_message_bytes\n", size >> 20);
+            else
+                perror("write failed");
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+static int run(const char *backing, size_t size, unsigned long loads)
+{
+    const unsigned long long *words;
+    size_t nwords = size / sizeof(*words);
+    unsigned long long sum = 0, x = 88172645463325252ULL;
+    double t0, t_fault, t_seq, t_rand;
+    unsigned long i;
+    void *map;
+    int fd;
+
+    fd = open(DEVICE_PATH, O_RDWR);
+    if (fd < 0)
+    {
+        perror("Can't open device file");
+        return -1;
+    }
+
+    if (write_message(fd, size) < 0)
+        goto error;
+
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, CHARDEV_MMAP_MESSAGE);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap failed");
+        goto error;
+    }
+    words = map;
+
+    /* First touch: page faults, one per page or one per PMD */
+    t0 = now_sec();
+    for (i = 0; i < nwords; i += 4096 / sizeof(*words))
+        sum += words[i];
+    t_fault = now_sec() - t0;
+
+    t0 = now_sec();
+    for (i = 0; i < nwords; i++)
+        sum += words[i];
+    t_seq = now_sec() - t0;
+
+    t0 = now_sec();
+    for (i = 0; i < loads; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        sum += words[x % nwords];
+    }
+    t_rand = now_sec() - t0;
+
+    printf("%s,%zu,%.3f,%.2f,%.2f,%llu\n", backing, size >> 20, t_fault * 1e3,
+           size / t_seq / 1e9, t_rand * 1e9 / loads, sum & 1);
+
+    munmap(map, size);
+    close(fd);
+    return 0;
+
+error:
+    close(fd);
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size = (argc > 1 ? strtoul(argv[1], NULL, 0) : 512) << 20;
+    unsigned long loads = argc > 2 ? strtoul(argv[2], NULL, 0) : 20000000;
+    unsigned long old_cap = 0, need;
+    int old_order, huge, cap_raised = 0, ret = 0;
+    char name[16];
+
+    /* Each growing append allocates room for up to twice the message while
+     * still holding the buffer it outgrew, up to its size, and both are
+     * rounded up to whole chunks: four times the message covers that
+     */
+    need = 4 * size;
+    if (get_cap(&old_cap) == 0 && old_cap && old_cap < need)
+    {
+        cap_raised = set_cap(need) == 0;
+        if (!cap_raised)
+            fprintf(stderr, "can't raise max_message_bytes to %lu\n", need);
+    }
+
+    printf("backing,message_mb,first_touch_ms,seq_gb_per_s,random_ns_per_load,checksum\n");
+
+    old_order = get_order();
+    huge = pmd_order();
+    if (huge < 0)
+        huge = old_order;
+    if (old_order >= 0 && set_order(huge) == 0)
+    {
+        if (huge > 0)
+            ret |= run(backing_name(huge, name, sizeof(name)), size, loads);
+        set_order(0);
+        ret |= run(backing_name(0, name, sizeof(name)), size, loads);
+        set_order(old_order);
+    }
+    else
+    {
+        fprintf(stderr, "can't change %s, measuring current backing only\n", ORDER_PARAM);
+        ret = run(backing_name(old_order, name, sizeof(name)), size, loads);
+    }
+
+    if (cap_raised)
+        set_cap(old_cap);
+    return ret ? EXIT_FAILURE : 0;
+}
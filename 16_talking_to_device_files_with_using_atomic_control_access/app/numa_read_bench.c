@@ -0,0 +1,331 @@
+/*
+ * numa_read_bench.c - read the chardev message from every NUMA node at once
+ * and report per-node read bandwidth, with and without per-node replicas.
+ *
+ * One thread per node is pinned to that node's CPUs and reads the whole
+ * message with pread() in a loop. When run as root the benchmark toggles
+ * the numa_replicate module parameter itself and measures both settings;
+ * otherwise it measures whatever the module is currently configured for.
+ * Replicas count against max_message_bytes like the message does, so the
+ * cap is raised for the run when it is too low, and the replicated run is
+ * skipped when it can't be, rather than reporting reads that fell back to
+ * the shared copy. Load the module with exclusive=0 so the threads can share
+ * the device.
+ *
+ * Build: gcc -O2 -pthread -o numa_read_bench numa_read_bench.c
+ * Usage: ./numa_read_bench [message_mb] [seconds]
+ */
+
+#define _GNU_SOURCE
+#include "../chardev.h"
+#include <stdio.h>     /* standard I/O */
+#include <errno.h>     /* errno */
+#include <fcntl.h>     /* open */
+#include <unistd.h>    /* close, pread, write */
+#include <stdlib.h>    /* exit, strtoul, malloc */
+#include <string.h>    /* memset */
+#include <time.h>      /* clock_gettime */
+#include <pthread.h>   /* pthread_create */
+#include <sched.h>     /* cpu_set_t */
+
+#define REPLICATE_PARAM "/sys/module/chardev/parameters/numa_replicate"
+#define CAP_PARAM "/sys/module/chardev/parameters/max_message_bytes"
+#define NODE_CPULIST "/sys/devices/system/node/node%d/cpulist"
+#define MAX_NODES 64
+#define WRITE_CHUNK (1 << 20)
+
+struct reader
+{
+    pthread_t thread;
+    int node;
+    cpu_set_t cpus;
+    size_t size;
+    double seconds;
+    double bytes;
+    double elapsed;
+    int failed;
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Parse a sysfs cpulist such as "0-3,8-11"; returns 0 if the node exists */
+static int node_cpus(int node, cpu_set_t *set)
+{
+    char path[64], list[4096], *p;
+    FILE *f;
+
+    snprintf(path, sizeof(path), NODE_CPULIST, node);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (!fgets(list, sizeof(list), f))
+        list[0] = '\0';
+    fclose(f);
+
+    CPU_ZERO(set);
+    for (p = list; *p && *p != '\n';)
+    {
+        unsigned long lo = strtoul(p, &p, 10), hi = lo;
+
+        if (*p == '-')
+            hi = strtoul(p + 1, &p, 10);
+        for (; lo <= hi; lo++)
+            CPU_SET(lo, set);
+        if (*p == ',')
+            p++;
+    }
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+/* Returns 0 if the parameter could be written */
+static int set_replicate(int on)
+{
+    FILE *f = fopen(REPLICATE_PARAM, "w");
+    int ret;
+
+    if (!f)
+        return -1;
+    ret = fprintf(f, "%c\n", on ? 'Y' : 'N') < 0 ? -1 : 0;
+    if (fclose(f))
+        ret = -1;
+    return ret;
+}
+
+static int get_replicate(void)
+{
+    FILE *f = fopen(REPLICATE_PARAM, "r");
+    int c;
+
+    if (!f)
+        return -1;
+    c = fgetc(f);
+    fclose(f);
+    return c == 'Y';
+}
+
+/* Returns 0 if the parameter could be written */
+static int set_cap(unsigned long bytes)
+{
+    FILE *f = fopen(CAP_PARAM, "w");
+    int ret;
+
+    if (!f)
+        return -1;
+    ret = fprintf(f, "%lu\n", bytes) < 0 ? -1 : 0;
+    if (fclose(f))
+        ret = -1;
+    return ret;
+}
+
+static int get_cap(unsigned long *bytes)
+{
+    FILE *f = fopen(CAP_PARAM, "r");
+    int ret;
+
+    if (!f)
+        return -1;
+    ret = fscanf(f, "%lu", bytes) == 1 ? 0 : -1;
+    fclose(f);
+    return ret;
+}
+
+/* Publish a message of size bytes: consecutive writes on a fresh fd append */
+static int write_message(size_t size)
+{
+    static char chunk[WRITE_CHUNK];
+    size_t done = 0;
+    int fd;
+
+    fd = open(DEVICE_PATH, O_RDWR);
+    if (fd < 0)
+    {
+        perror("Can't open device file");
+        return -1;
+    }
+
+    memset(chunk, 'x', sizeof(chunk));
+    while (done < size)
+    {
+        size_t len = size - done < sizeof(chunk) ? size - done : sizeof(chunk);
+        ssize_t ret = write(fd, chunk, len);
+
+        if (ret < 0)
+        {
+            if (errno == ENOSPC)
+                fprintf(stderr, "a %zu MiB message doesn't fit in max_message_bytes\n", size >> 20);
+            else
+                perror("write failed");
+            close(fd);
+            return -1;
+        }
+        done += ret;
+    }
+    close(fd);
+    return 0;
+}
+
+static void *read_loop(void *arg)
+{
+    struct reader *r = arg;
+    char *buf = malloc(r->size);
+    double start, end;
+    int fd;
+
+    if (!buf || pthread_setaffinity_np(pthread_self(), sizeof(r->cpus), &r->cpus))
+    {
+        r->failed = 1;
+        free(buf);
+        return NULL;
+    }
+
+    fd = open(DEVICE_PATH, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("Can't open device file");
+        r->failed = 1;
+        free(buf);
+        return NULL;
+    }
+
+    start = now_sec();
+    end = start + r->seconds;
+    do
+    {
+        size_t done = 0;
+
+        while (done < r->size)
+        {
+            ssize_t ret = pread(fd, buf + done, r->size - done, done);
+
+            if (ret <= 0)
+            {
+                r->failed = 1;
+                goto out;
+            }
+            done += ret;
+        }
+        r->bytes += done;
+    } while (now_sec() < end);
+    r->elapsed = now_sec() - start;
+
+out:
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+static int run(const char *mode, struct reader *readers, int nodes)
+{
+    double total = 0;
+    int i, ret = 0;
+
+    for (i = 0; i < nodes; i++)
+    {
+        readers[i].bytes = 0;
+        readers[i].failed = 0;
+        if (pthread_create(&readers[i].thread, NULL, read_loop, &readers[i]))
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            nodes = i;
+            ret = -1;
+            break;
+        }
+    }
+
+    for (i = 0; i < nodes; i++)
+    {
+        pthread_join(readers[i].thread, NULL);
+        if (readers[i].failed)
+        {
+            fprintf(stderr, "reader on node %d failed\n", readers[i].node);
+            ret = -1;
+            continue;
+        }
+        printf("%s,%d,%zu,%.2f\n", mode, readers[i].node, readers[i].size >> 20,
+               readers[i].bytes / readers[i].elapsed / 1e9);
+        total += readers[i].bytes / readers[i].elapsed;
+    }
+    printf("%s,all,%zu,%.2f\n", mode, readers[0].size >> 20, total / 1e9);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size = (argc > 1 ? strtoul(argv[1], NULL, 0) : 64) << 20;
+    double seconds = argc > 2 ? strtod(argv[2], NULL) : 5;
+    struct reader readers[MAX_NODES];
+    unsigned long old_cap = 0, need;
+    int node, nodes = 0, old, cap_raised = 0, fits, ret = 0;
+
+    for (node = 0; node < MAX_NODES; node++)
+    {
+        if (node_cpus(node, &readers[nodes].cpus) < 0)
+            continue;
+        readers[nodes].node = node;
+        readers[nodes].size = size;
+        readers[nodes].seconds = seconds;
+        nodes++;
+    }
+    if (nodes == 0)
+    {
+        fprintf(stderr, "no NUMA nodes with CPUs found\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Each growing append allocates room for up to twice the message while
+     * still holding the buffer it outgrew, up to its size, and both are
+     * rounded up to whole chunks. Then every other node adds a replica of
+     * its size. Four times the message plus one per node covers that.
+     */
+    need = size * (4 + nodes);
+    if (get_cap(&old_cap) < 0)
+        fits = 0;
+    else if (old_cap == 0 || old_cap >= need)
+        fits = 1;
+    else
+        fits = cap_raised = set_cap(need) == 0;
+    if (!fits)
+        fprintf(stderr, "can't make max_message_bytes at least %lu, replicas may not fit\n", need);
+
+    if (write_message(size) < 0)
+    {
+        ret = -1;
+        goto out;
+    }
+
+    printf("mode,node,message_mb,gb_per_s\n");
+
+    old = get_replicate();
+    if (old >= 0 && set_replicate(0) == 0)
+    {
+        ret |= run("shared", readers, nodes);
+        if (fits)
+        {
+            set_replicate(1);
+            ret |= run("replicated", readers, nodes);
+        }
+        else
+        {
+            fprintf(stderr, "skipping replicated run, reads would fall back to the shared copy\n");
+        }
+        set_replicate(old);
+    }
+    else
+    {
+        fprintf(stderr, "can't change %s, measuring current setting only\n", REPLICATE_PARAM);
+        if (old > 0 && !fits)
+            fprintf(stderr, "replicated numbers may include reads of the shared copy\n");
+        ret = run(old > 0 ? "replicated" : "shared", readers, nodes);
+    }
+
+out:
+    if (cap_raised)
+        set_cap(old_cap);
+    return ret ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * ring_app.c - stream records through the mmap'd ring of the chardev module
+ *
+ * The parent is the producer and the child is the consumer. Both map the
+ * same ring, push and pop records with plain loads and stores, and only
+ * enter the kernel to sleep or to wake the other side.
+ *
+ * Build: gcc -O2 -o ring_app ring_app.c
+ * Usage: ./ring_app [records] [record_bytes] [ring_bytes]
+ */
+
+#include "../chardev.h"
+#include <stdio.h>     /* standard I/O */
+#include <fcntl.h>     /* open */
+#include <unistd.h>    /* close, fork */
+#include <stdlib.h>    /* exit, strtoul */
+#include <string.h>    /* memset */
+#include <time.h>      /* clock_gettime */
+#include <sys/ioctl.h> /* ioctl */
+#include <sys/mman.h>  /* mmap */
+#include <sys/wait.h>  /* waitpid */
+
+#define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define full_barrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static unsigned long kicks;
+static unsigned long sleeps;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static __u32 record_bytes(__u32 len)
+{
+    return (sizeof(struct chardev_ring_record) + len + CHARDEV_RING_ALIGN - 1) &
+           ~(CHARDEV_RING_ALIGN - 1);
+}
+
+/* Wake the other side only if it said it is going to sleep */
+static void kick_if_waiting(int fd, __u32 *waiting)
+{
+    full_barrier();
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED))
+    {
+        ioctl(fd, IOCTL_RING_KICK);
+        kicks++;
+    }
+}
+
+static void produce(int fd, struct chardev_ring *ring, unsigned long count, __u32 len)
+{
+    char *data = (char *)ring + ring->data_offset;
+    __u32 mask = ring->size - 1;
+    __u64 head = ring->head;
+    unsigned long i;
+
+    for (i = 0; i < count; i++)
+    {
+        __u32 need = record_bytes(len);
+        __u32 pos = head & mask;
+        __u32 to_end = ring->size - pos;
+        struct chardev_ring_record *rec;
+
+        /* A record never straddles the end: pad to the start instead */
+        if (to_end < need)
+            need += to_end;
+
+        while (head - load_acquire(&ring->tail) > ring->size - need)
+        {
+            ring->producer_waiting = 1;
+            full_barrier();
+            if (head - load_acquire(&ring->tail) > ring->size - need)
+            {
+                ioctl(fd, IOCTL_RING_WAIT_SPACE, need);
+                sleeps++;
+            }
+            ring->producer_waiting = 0;
+        }
+
+        if (to_end < record_bytes(len))
+        {
+            rec = (struct chardev_ring_record *)(data + pos);
+            rec->len = CHARDEV_RING_PAD;
+            head += to_end;
+            pos = 0;
+        }
+
+        rec = (struct chardev_ring_record *)(data + pos);
+        rec->len = len;
+        memset(rec + 1, (int)(i & 0xff), len);
+        head += record_bytes(len);
+
+        store_release(&ring->head, head);
+        kick_if_waiting(fd, &ring->consumer_waiting);
+    }
+}
+
+static int consume(int fd, struct chardev_ring *ring, unsigned long count)
+{
+    char *data = (char *)ring + ring->data_offset;
+    __u32 mask = ring->size - 1;
+    __u64 tail = ring->tail;
+    unsigned long i = 0;
+
+    while (i < count)
+    {
+        struct chardev_ring_record *rec;
+
+        while (load_acquire(&ring->head) == tail)
+        {
+            ring->consumer_waiting = 1;
+            full_barrier();
+            if (load_acquire(&ring->head) == tail)
+            {
+                ioctl(fd, IOCTL_RING_WAIT_DATA);
+                sleeps++;
+            }
+            ring->consumer_waiting = 0;
+        }
+
+        rec = (struct chardev_ring_record *)(data + (tail & mask));
+        if (rec->len == CHARDEV_RING_PAD)
+        {
+            tail += ring->size - (tail & mask);
+        }
+        else
+        {
+            if (rec->len && ((unsigned char *)(rec + 1))[0] != (i & 0xff))
+            {
+                fprintf(stderr, "record %lu is corrupted\n", i);
+                return -1;
+            }
+            tail += record_bytes(rec->len);
+            i++;
+        }
+
+        store_release(&ring->tail, tail);
+        kick_if_waiting(fd, &ring->producer_waiting);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long count = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+    __u32 len = argc > 2 ? strtoul(argv[2], NULL, 0) : 64;
+    __u32 size = argc > 3 ? strtoul(argv[3], NULL, 0) : 1 << 20;
+    struct chardev_ring *ring;
+    int file_desc, status;
+    double start, elapsed;
+    pid_t pid;
+
+    if (record_bytes(len) > size / 2)
+    {
+        fprintf(stderr, "record_bytes must be well below ring_bytes\n");
+        exit(EXIT_FAILURE);
+    }
+
+    file_desc = open(DEVICE_PATH, O_RDWR);
+    if (file_desc < 0)
+    {
+        perror("Can't open device file");
+        exit(EXIT_FAILURE);
+    }
+
+    if (ioctl(file_desc, IOCTL_RING_SETUP, size) < 0)
+    {
+        perror("ioctl_ring_setup failed");
+        goto error;
+    }
+
+    ring = mmap(NULL, CHARDEV_RING_DATA_OFFSET + size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                file_desc, 0);
+    if (ring == MAP_FAILED)
+    {
+        perror("mmap failed");
+        goto error;
+    }
+
+    start = now_sec();
+    pid = fork();
+    if (pid < 0)
+    {
+        perror("fork failed");
+        goto error;
+    }
+    if (pid == 0)
+    {
+        status = consume(file_desc, ring, count);
+        printf("consumer: %lu sleeps, %lu kicks\n", sleeps, kicks);
+        fflush(stdout);
+        _exit(status ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    produce(file_desc, ring, count, len);
+    waitpid(pid, &status, 0);
+    elapsed = now_sec() - start;
+    printf("producer: %lu sleeps, %lu kicks\n", sleeps, kicks);
+    printf("%lu records of %u bytes in %.3f s: %.0f records/s\n", count, len, elapsed,
+           count / elapsed);
+
+    munmap(ring, CHARDEV_RING_DATA_OFFSET + size);
+    close(file_desc);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : EXIT_FAILURE;
+
+error:
+    close(file_desc);
+    exit(EXIT_FAILURE);
+}
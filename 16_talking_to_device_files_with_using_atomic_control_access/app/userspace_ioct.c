@@ -2,12 +2,19 @@
  * userspace_ioctl.c - userspace process to test ioctl interface
  */
 
+#define _GNU_SOURCE
 #include "../chardev.h"
 #include <stdio.h>     /* standard I/O */
-#include <fcntl.h>     /* open */
-#include <unistd.h>    /* close */
+#include <fcntl.h>     /* open, F_ADD_SEALS */
+#include <unistd.h>    /* close, write */
 #include <stdlib.h>    /* exit */
+#include <string.h>    /* strlen, memcpy */
 #include <sys/ioctl.h> /* ioctl */
+#include <sys/mman.h>  /* memfd_create, mmap */
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
 
 /* Set the message via ioctl */
 int ioctl_set_msg(int file_desc, const char *message)
@@ -23,6 +30,48 @@ int ioctl_set_msg(int file_desc, const char *message)
     return ret_val;
 }
 
+/* Hand pages to the driver without a copy. The driver only adopts memory
+ * that can't be written any more, so the text goes into a memfd that is
+ * sealed against writes and mapped read-only.
+ */
+int ioctl_set_msg_pages(int file_desc, const char *buf, size_t len)
+{
+    struct chardev_msg_pages req = {.len = len};
+    int memfd, ret_val = -1;
+    void *map;
+
+    memfd = memfd_create("chardev_msg", MFD_ALLOW_SEALING);
+    if (memfd < 0)
+    {
+        perror("memfd_create failed");
+        return -1;
+    }
+    if (write(memfd, buf, len) != (ssize_t)len ||
+        fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_FUTURE_WRITE) < 0)
+    {
+        perror("sealing the message failed");
+        goto out;
+    }
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, memfd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap failed");
+        goto out;
+    }
+
+    req.addr = (unsigned long)map;
+    ret_val = ioctl(file_desc, IOCTL_SET_MSG_PAGES, &req);
+    if (ret_val < 0)
+    {
+        perror("ioctl_set_msg_pages failed");
+    }
+    munmap(map, len); // the driver keeps the pages
+
+out:
+    close(memfd);
+    return ret_val;
+}
+
 /* Get the message via ioctl */
 int ioctl_get_msg(int file_desc)
 {
@@ -40,6 +89,53 @@ int ioctl_get_msg(int file_desc)
     return ret_val;
 }
 
+/* Print the message digest; an unchanged generation means an unchanged message */
+int ioctl_get_digest(int file_desc)
+{
+    struct chardev_digest digest;
+    int ret_val;
+
+    ret_val = ioctl(file_desc, IOCTL_GET_DIGEST, &digest);
+    if (ret_val < 0)
+    {
+        perror("ioctl_get_digest failed");
+        return ret_val;
+    }
+    printf("ioctl_get_digest generation %llu, %llu bytes, crc32c %08x\n",
+           (unsigned long long)digest.generation, (unsigned long long)digest.size, digest.crc32c);
+    return 0;
+}
+
+/* Print where pattern occurs in the message, without fetching the message */
+int ioctl_search(int file_desc, const char *pattern)
+{
+    __u64 offsets[16];
+    struct chardev_search req = {
+        .offsets = (unsigned long)offsets,
+        .max_offsets = 16,
+        .pattern_len = strlen(pattern),
+    };
+    int ret_val;
+    __u32 i;
+
+    memcpy(req.pattern, pattern, req.pattern_len);
+
+    do
+    {
+        ret_val = ioctl(file_desc, IOCTL_SEARCH, &req);
+        if (ret_val < 0)
+        {
+            perror("ioctl_search failed");
+            return ret_val;
+        }
+        for (i = 0; i < req.found; i++)
+            printf("ioctl_search \"%s\" at %llu\n", pattern, (unsigned long long)offsets[i]);
+        req.start = req.next;
+    } while (req.found == req.max_offsets);
+
+    return 0;
+}
+
 /* Print each byte of the message via ioctl */
 int ioctl_get_nth_byte(int file_desc)
 {
@@ -68,6 +164,7 @@ int main(void)
 {
     int file_desc, ret_val;
     const char *msg = "Message passed by ioctl\n";
+    static const char pages_msg[] = "Message passed by pinned pages\n";
 
     file_desc = open(DEVICE_PATH, O_RDWR);
     if (file_desc < 0)
@@ -88,6 +185,22 @@ int main(void)
     if (ret_val < 0)
         goto error;
 
+    ret_val = ioctl_search(file_desc, "ss");
+    if (ret_val < 0)
+        goto error;
+
+    ret_val = ioctl_get_digest(file_desc);
+    if (ret_val < 0)
+        goto error;
+
+    ret_val = ioctl_set_msg_pages(file_desc, pages_msg, strlen(pages_msg));
+    if (ret_val < 0)
+        goto error;
+
+    ret_val = ioctl_get_msg(file_desc);
+    if (ret_val < 0)
+        goto error;
+
     close(file_desc);
     return 0;
 
@@ -8,10 +8,35 @@
 #include <linux/fs.h>          // For file_operations structure
 #include <linux/init.h>        // For __init and __exit macros
 #include <linux/kernel.h>      // For printk and pr_info
+#include <linux/kref.h>        // For large message lifetime across mappings
+#include <linux/log2.h>        // For is_power_of_2, roundup_pow_of_two
+#include <linux/lz4.h>         // For compressed messages, needs CONFIG_LZ4_COMPRESS
+#include <linux/memcontrol.h>  // For keying spare buffers by memory cgroup
+#include <linux/mm.h>          // For vm_area_struct and vm_operations_struct
 #include <linux/module.h>      // For all kernel modules
-#include <linux/slab.h>        // For kmalloc and kfree
+#include <linux/moduleparam.h> // For module_param
+#include <linux/nodemask.h>    // For num_online_nodes
+#include <linux/numa.h>        // For MAX_NUMNODES
+#include <linux/poll.h>        // For poll_wait and EPOLL* masks
+#include <linux/rwsem.h>       // For the message lock
+#include <linux/shrinker.h>    // For giving spare buffers back under memory pressure
+#include <linux/slab.h>        // For kvmalloc and kvfree
+#include <linux/spinlock.h>    // For the spare buffer lock
+#include <linux/topology.h>    // For numa_node_id
 #include <linux/uaccess.h>     // For copy_to_user and copy_from_user
+#include <linux/uio.h>         // For iov_iter and copy_to_iter/copy_from_iter
 #include <linux/version.h>     // For kernel version checks
+#include <linux/vmalloc.h>     // For vmalloc_user and remap_vmalloc_range
+#include <linux/wait.h>        // For the ring wait queue
+#include <asm/word-at-a-time.h> // For searching a word at a time
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+#include <linux/pfn_t.h>       // For pfn_to_pfn_t
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+#include <linux/crc32.h>       // For crc32c
+#else
+#include <linux/crc32c.h>      // For crc32c, from libcrc32c
+#endif
 
 #include "chardev.h"
 
@@ -26,62 +51,1433 @@ enum
 /* Atomic to prevent concurrent open */
 static atomic_t already_open = ATOMIC_INIT(CDEV_NOT_USED);
 
+/* Load with exclusive=0 to let several processes open the device, e.g. a ring
+ * producer and a ring consumer that are not parent and child.
+ */
+static bool exclusive = true;
+module_param(exclusive, bool, 0444);
+MODULE_PARM_DESC(exclusive, "Allow a single open file at a time (default: true)");
+
 /* Dynamically allocated buffer for message */
 static char *message = NULL;
 static size_t message_size = 0;
+static size_t message_alloc = 0; // bytes allocated for message, including the null
+
+/* A message of at least large_msg_bytes is built from physically contiguous
+ * chunks of 2^large_msg_order pages instead of kvmalloc(). User space can map
+ * such a message read-only at CHARDEV_MMAP_MESSAGE; with PMD sized chunks each
+ * 2 MB is mapped by a single PMD, so long scans stop missing the TLB every
+ * 4 KB. large_msg_order=0 gives a 4 KB backed mapping to compare against.
+ */
+#define PMD_PAGE_ORDER (PMD_SHIFT - PAGE_SHIFT)
+
+static unsigned long large_msg_bytes = 2 << 20;
+module_param(large_msg_bytes, ulong, 0644);
+MODULE_PARM_DESC(large_msg_bytes, "Messages of at least this many bytes are page backed and mappable, 0 for never (default: 2 MiB)");
+
+static unsigned int large_msg_order = PMD_PAGE_ORDER;
+module_param(large_msg_order, uint, 0644);
+MODULE_PARM_DESC(large_msg_order, "Page order of the chunks backing large messages (default: PMD order)");
+
+struct large_msg
+{
+    struct kref ref;        // held by message and by every mapping
+    bool pinned;            // chunks are pinned user pages, see large_msg_pin()
+    unsigned int order;     // each chunk is 2^order pages
+    unsigned int nr_chunks;
+    size_t alloc;           // nr_chunks << (order + PAGE_SHIFT)
+    char *vaddr;            // vmap() of all chunks, what the kernel reads
+    struct page *chunks[];
+};
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+static inline int pin_user_pages_fast(unsigned long start, int nr_pages, unsigned int gup_flags,
+                                      struct page **pages)
+{
+    return get_user_pages_fast(start, nr_pages, gup_flags, pages);
+}
+
+static inline void unpin_user_pages(struct page **pages, unsigned long npages)
+{
+    while (npages--)
+        put_page(pages[npages]);
+}
+#endif
+
+/* Backing of message when it is a large message, NULL otherwise */
+static struct large_msg *message_large = NULL;
+
+/* With compress=1 a message started afterwards is stored LZ4 compressed, in
+ * independent chunks of compress_chunk_bytes, so a ranged read decompresses
+ * only the chunks it touches. The bytes after the last full chunk are kept
+ * uncompressed until the chunk fills, so appending writes never recompress.
+ * Compressed messages can not be mapped.
+ */
+static bool compress = false;
+module_param(compress, bool, 0644);
+MODULE_PARM_DESC(compress, "Store new messages LZ4 compressed (default: false)");
+
+static unsigned int compress_chunk_bytes = 64 << 10;
+module_param(compress_chunk_bytes, uint, 0644);
+MODULE_PARM_DESC(compress_chunk_bytes, "Uncompressed bytes per compressed chunk, 4 KiB to 1 MiB (default: 64 KiB)");
+
+#define ZMSG_MIN_CHUNK PAGE_SIZE
+#define ZMSG_MAX_CHUNK (1U << 20)
+
+struct zchunk
+{
+    void *data;
+    size_t alloc;
+    u32 zlen; // compressed bytes, 0 when the chunk did not compress
+};
+
+struct zmsg
+{
+    size_t size;             // uncompressed bytes, full chunks plus tail
+    size_t stored;           // bytes allocated for chunk data
+    unsigned int chunk;      // uncompressed bytes per chunk
+    unsigned int nr_chunks;  // full chunks
+    unsigned int max_chunks; // slots in chunks
+    struct zchunk *chunks;
+    char *tail;              // size - nr_chunks * chunk bytes, room for chunk
+    size_t tail_alloc;
+};
+
+/* Compressed store of message, which is NULL while this is set */
+static struct zmsg *message_z = NULL;
+
+/* Compression scratch, used under message_lock held for write */
+static void *lz4_wrkmem = NULL;
+static char *lz4_out = NULL;
+
+/* CRC32C of the message, extended as appending writes come in, and a
+ * generation count bumped on every change, so a client can check the message
+ * with IOCTL_GET_DIGEST instead of reading it back. message_crc is the running
+ * value, the digest is its complement.
+ */
+static u32 message_crc = ~0U;
+static u64 message_gen = 0;
+
+/* Protects message and the ring pointer once the device can be shared.
+ * Readers of message share it, so they copy out in parallel.
+ */
+static DECLARE_RWSEM(message_lock);
+
+/* With numa_replicate=1 the first read from a NUMA node copies message to
+ * memory on that node, and later readers there copy from the local replica
+ * instead of pulling every byte across the interconnect. Replicas are
+ * dropped whenever message changes, and by the shrinker.
+ */
+static bool numa_replicate = false;
+module_param(numa_replicate, bool, 0644);
+MODULE_PARM_DESC(numa_replicate, "Serve reads from per NUMA node copies of the message (default: false)");
+
+struct msg_replica
+{
+    size_t alloc;
+    char data[];
+};
+
+/* Installed with cmpxchg() under message_lock held for read */
+static struct msg_replica *message_replicas[MAX_NUMNODES];
+
+/* Bytes held by message_replicas, so the shrinker can count them without
+ * message_lock
+ */
+static atomic_long_t replica_bytes = ATOMIC_LONG_INIT(0);
+
+/* Shared single-producer/single-consumer ring, see struct chardev_ring */
+static struct chardev_ring *ring = NULL;
+static u32 ring_size = 0;
+
+/* Mappings of the ring plus sleepers in ring_wait(). The ring is only
+ * replaced or freed while nobody uses it.
+ */
+static atomic_t ring_users = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(ring_waitq);
+
+/* With queue_depth > 0 every write() enqueues one message and every read()
+ * dequeues one, instead of overwriting and reading back a single message.
+ * The ioctls keep working on the single message in both modes.
+ */
+static unsigned int queue_depth = 0;
+module_param(queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "Messages held in FIFO queue mode, 0 keeps a single message (default: 0)");
+
+struct queued_msg
+{
+    struct list_head list;
+    size_t size;
+    size_t alloc; // bytes allocated for the whole struct
+    char data[];
+};
+
+/* FIFO of struct queued_msg, protected by message_lock */
+static LIST_HEAD(msg_queue);
+static unsigned int queue_len = 0;
+
+/* Readers wait for a message, writers wait for a free slot */
+static DECLARE_WAIT_QUEUE_HEAD(queue_readq);
+static DECLARE_WAIT_QUEUE_HEAD(queue_writeq);
+
+/* Every buffer holding message bytes is allocated with GFP_KERNEL_ACCOUNT, so
+ * it is charged to the memory cgroup of the writer, and counted against
+ * max_message_bytes. 0 disables the cap.
+ */
+static unsigned long max_message_bytes = 64 << 20;
+module_param(max_message_bytes, ulong, 0644);
+MODULE_PARM_DESC(max_message_bytes, "Cap on memory held for messages in bytes, 0 for none (default: 64 MiB)");
+
+/* Bytes currently allocated for messages, spare buffers included */
+static atomic_long_t message_bytes = ATOMIC_LONG_INIT(0);
+
+/* Buffers of replaced or dequeued messages are kept here and reused by the
+ * next allocation of a similar size, instead of a kvfree()/kvmalloc() pair per
+ * write. The shrinker empties this cache under memory pressure. A buffer
+ * stays charged to the memory cgroup that allocated it, so it is only reused
+ * by an allocation from that same cgroup.
+ */
+#define MSG_SPARES 4
+
+/* In front of every msg_alloc() buffer: the memory cgroup it is charged to,
+ * with a reference held until the buffer is freed
+ */
+struct msg_hdr
+{
+    struct mem_cgroup *memcg;
+} __aligned(16);
+
+struct msg_spare
+{
+    void *buf;
+    size_t alloc;
+};
+
+static struct msg_spare msg_spares[MSG_SPARES];
+static size_t spare_bytes = 0;
+static DEFINE_SPINLOCK(spare_lock); // not message_lock: the shrinker may run under it
+
+static struct shrinker *msg_shrinker;
+
+static struct class *cls = NULL;
+
+static struct msg_hdr *msg_hdr(void *buf)
+{
+    return (struct msg_hdr *)buf - 1;
+}
+
+static void msg_release(void *buf)
+{
+    struct msg_hdr *hdr = msg_hdr(buf);
+
+    mem_cgroup_put(hdr->memcg);
+    kvfree(hdr);
+}
+
+static bool msg_charge(size_t size)
+{
+    unsigned long cap = READ_ONCE(max_message_bytes);
+
+    if (atomic_long_add_return(size, &message_bytes) > cap && cap) {
+        atomic_long_sub(size, &message_bytes);
+        return false;
+    }
+    return true;
+}
+
+/* Free spare buffers worth at least want bytes, returns the bytes freed */
+static size_t msg_drop_spares(size_t want)
+{
+    struct msg_spare dropped[MSG_SPARES];
+    size_t freed = 0;
+    int i, n = 0;
+
+    spin_lock(&spare_lock);
+    for (i = 0; i < MSG_SPARES && freed < want; i++) {
+        if (!msg_spares[i].buf)
+            continue;
+        dropped[n++] = msg_spares[i];
+        freed += msg_spares[i].alloc;
+        msg_spares[i].buf = NULL;
+    }
+    spare_bytes -= freed;
+    spin_unlock(&spare_lock);
+
+    /* kvfree() may sleep for vmalloc'ed buffers */
+    for (i = 0; i < n; i++)
+        msg_release(dropped[i].buf);
+    atomic_long_sub(freed, &message_bytes);
+
+    return freed;
+}
+
+/* msg_charge(), giving back what the spares hold before failing */
+static bool msg_reserve(size_t size)
+{
+    if (msg_charge(size))
+        return true;
+
+    msg_drop_spares(SIZE_MAX);
+    return msg_charge(size);
+}
+
+/* Allocate at least size bytes of message memory; *alloc receives the size
+ * actually reserved. Returns ERR_PTR(-ENOSPC) when max_message_bytes is hit.
+ */
+static void *msg_alloc(size_t size, size_t *alloc)
+{
+    struct mem_cgroup *memcg = get_mem_cgroup_from_mm(current->mm);
+    struct msg_hdr *hdr;
+    void *buf = NULL;
+    int i;
+
+    /* Reuse a spare of our cgroup that fits without wasting more than half
+     * of it
+     */
+    spin_lock(&spare_lock);
+    for (i = 0; i < MSG_SPARES; i++) {
+        if (msg_spares[i].buf && msg_hdr(msg_spares[i].buf)->memcg == memcg &&
+            msg_spares[i].alloc >= size && msg_spares[i].alloc / 2 <= size) {
+            buf = msg_spares[i].buf;
+            *alloc = msg_spares[i].alloc;
+            msg_spares[i].buf = NULL;
+            spare_bytes -= *alloc;
+            break;
+        }
+    }
+    spin_unlock(&spare_lock);
+    if (buf) {
+        mem_cgroup_put(memcg); // the spare holds its own reference
+        return buf;
+    }
+
+    if (!msg_reserve(size)) {
+        mem_cgroup_put(memcg);
+        return ERR_PTR(-ENOSPC);
+    }
+
+    hdr = kvmalloc(sizeof(*hdr) + size, GFP_KERNEL_ACCOUNT);
+    if (!hdr) {
+        atomic_long_sub(size, &message_bytes);
+        mem_cgroup_put(memcg);
+        return ERR_PTR(-ENOMEM);
+    }
+    hdr->memcg = memcg;
+
+    *alloc = size;
+    return hdr + 1;
+}
+
+/* Release a buffer from msg_alloc(), keeping it as a spare if there is room */
+static void msg_free(void *buf, size_t alloc)
+{
+    int i;
+
+    if (!buf)
+        return;
+
+    spin_lock(&spare_lock);
+    for (i = 0; i < MSG_SPARES; i++) {
+        if (!msg_spares[i].buf) {
+            msg_spares[i].buf = buf;
+            msg_spares[i].alloc = alloc;
+            spare_bytes += alloc;
+            buf = NULL;
+            break;
+        }
+    }
+    spin_unlock(&spare_lock);
+
+    if (buf) {
+        msg_release(buf);
+        atomic_long_sub(alloc, &message_bytes);
+    }
+}
+
+static void large_msg_free_chunks(struct large_msg *lm)
+{
+    unsigned int i;
+
+    if (lm->pinned)
+        unpin_user_pages(lm->chunks, lm->nr_chunks);
+    else
+        for (i = 0; i < lm->nr_chunks; i++)
+            __free_pages(lm->chunks[i], lm->order);
+    atomic_long_sub(lm->alloc, &message_bytes);
+    kvfree(lm);
+}
+
+static void large_msg_release(struct kref *ref)
+{
+    struct large_msg *lm = container_of(ref, struct large_msg, ref);
+
+    vunmap(lm->vaddr);
+    large_msg_free_chunks(lm);
+}
+
+/* Build a large message of at least size bytes. Falls back to order-0 chunks
+ * when memory is too fragmented for large_msg_order.
+ */
+static struct large_msg *large_msg_alloc(size_t size)
+{
+    unsigned int order = READ_ONCE(large_msg_order);
+    unsigned int nr, i, j;
+    struct large_msg *lm;
+    struct page **pages;
+    size_t chunk;
+
+retry:
+    chunk = PAGE_SIZE << order;
+    nr = DIV_ROUND_UP(size, chunk);
+
+    lm = kvzalloc(struct_size(lm, chunks, nr), GFP_KERNEL_ACCOUNT);
+    if (!lm)
+        return ERR_PTR(-ENOMEM);
+    lm->order = order;
+    lm->alloc = (size_t)nr * chunk;
+
+    if (!msg_reserve(lm->alloc)) {
+        kvfree(lm);
+        return ERR_PTR(-ENOSPC);
+    }
+
+    for (i = 0; i < nr; i++) {
+        lm->chunks[i] = alloc_pages(GFP_KERNEL_ACCOUNT | __GFP_COMP | __GFP_NOWARN |
+                                    (order ? __GFP_NORETRY : 0), order);
+        if (!lm->chunks[i])
+            break;
+        lm->nr_chunks++;
+    }
+    if (lm->nr_chunks < nr) {
+        large_msg_free_chunks(lm);
+        if (order) {
+            order = 0;
+            goto retry;
+        }
+        return ERR_PTR(-ENOMEM);
+    }
+
+    /* One linear kernel mapping, so every other path keeps using message */
+    pages = kvmalloc_array(lm->alloc >> PAGE_SHIFT, sizeof(*pages), GFP_KERNEL);
+    if (!pages) {
+        large_msg_free_chunks(lm);
+        return ERR_PTR(-ENOMEM);
+    }
+    for (i = 0; i < nr; i++)
+        for (j = 0; j < (1U << order); j++)
+            pages[(i << order) + j] = lm->chunks[i] + j;
+    lm->vaddr = vmap(pages, lm->alloc >> PAGE_SHIFT, VM_MAP, PAGE_KERNEL);
+    kvfree(pages);
+    if (!lm->vaddr) {
+        large_msg_free_chunks(lm);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    kref_init(&lm->ref);
+    return lm;
+}
+
+/* Whether [addr, addr + len) is mapped, and none of it is writable or can be
+ * made writable with mprotect(). Called with the mmap lock held.
+ */
+static bool user_range_sealed(struct mm_struct *mm, unsigned long addr, size_t len)
+{
+    unsigned long end = addr + len;
+    struct vm_area_struct *vma;
+
+    while (addr < end) {
+        vma = find_vma(mm, addr);
+        if (!vma || vma->vm_start > addr || (vma->vm_flags & (VM_WRITE | VM_MAYWRITE)))
+            return false;
+        addr = vma->vm_end;
+    }
+    return true;
+}
+
+/* Adopt the pages of the user buffer [addr, addr + len) as a message, without
+ * copying them. The pages stay pinned until the message is released; they
+ * count against max_message_bytes like memory allocated for a message.
+ * Only a buffer the caller can no longer write is accepted, such as a memfd
+ * sealed against writes, so the message can't change under its readers.
+ */
+static struct large_msg *large_msg_pin(unsigned long addr, size_t len)
+{
+    unsigned int nr = DIV_ROUND_UP(offset_in_page(addr) + len, PAGE_SIZE);
+    struct mm_struct *mm = current->mm;
+    struct large_msg *lm;
+    long pinned;
+
+    lm = kvzalloc(struct_size(lm, chunks, nr), GFP_KERNEL_ACCOUNT);
+    if (!lm)
+        return ERR_PTR(-ENOMEM);
+    lm->pinned = true;
+    lm->alloc = (size_t)nr << PAGE_SHIFT;
+
+    if (!msg_reserve(lm->alloc)) {
+        kvfree(lm);
+        return ERR_PTR(-ENOSPC);
+    }
+
+    /* Read-only pin: the driver never writes to the pages. Checked and pinned
+     * under one mmap lock, so the range can't be remapped in between.
+     */
+    mmap_read_lock(mm);
+    if (user_range_sealed(mm, addr, len)) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+        pinned = pin_user_pages(addr & PAGE_MASK, nr, FOLL_LONGTERM, lm->chunks);
+#else
+        pinned = pin_user_pages(addr & PAGE_MASK, nr, FOLL_LONGTERM, lm->chunks, NULL);
+#endif
+    } else {
+        pinned = -EACCES;
+    }
+    mmap_read_unlock(mm);
+    if (pinned > 0)
+        lm->nr_chunks = pinned;
+    if (pinned != nr) {
+        large_msg_free_chunks(lm);
+        return ERR_PTR(pinned < 0 ? pinned : -EFAULT);
+    }
+
+    lm->vaddr = vmap(lm->chunks, nr, VM_MAP, PAGE_KERNEL);
+    if (!lm->vaddr) {
+        large_msg_free_chunks(lm);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    kref_init(&lm->ref);
+    return lm;
+}
+
+/* Allocate a buffer for the single message: a large message from
+ * large_msg_bytes on, a msg_alloc() buffer below.
+ */
+static char *message_buf_alloc(size_t size, size_t *alloc, struct large_msg **large)
+{
+    unsigned long threshold = READ_ONCE(large_msg_bytes);
+    struct large_msg *lm;
+
+    *large = NULL;
+    if (!threshold || size < threshold)
+        return msg_alloc(size, alloc);
+
+    lm = large_msg_alloc(size);
+    if (IS_ERR(lm))
+        return ERR_CAST(lm);
+
+    *large = lm;
+    *alloc = lm->alloc;
+    return lm->vaddr;
+}
+
+static void message_buf_free(char *buf, size_t alloc, struct large_msg *large)
+{
+    if (large)
+        kref_put(&large->ref, large_msg_release);
+    else
+        msg_free(buf, alloc);
+}
+
+static void zmsg_free(struct zmsg *zm)
+{
+    unsigned int i;
+
+    if (!zm)
+        return;
+
+    for (i = 0; i < zm->nr_chunks; i++)
+        msg_free(zm->chunks[i].data, zm->chunks[i].alloc);
+    kvfree(zm->chunks);
+    msg_free(zm->tail, zm->tail_alloc);
+    kfree(zm);
+}
+
+static struct zmsg *zmsg_alloc(void)
+{
+    struct zmsg *zm = kzalloc(sizeof(*zm), GFP_KERNEL_ACCOUNT);
+
+    if (!zm)
+        return ERR_PTR(-ENOMEM);
+
+    zm->chunk = clamp_val(READ_ONCE(compress_chunk_bytes), ZMSG_MIN_CHUNK, ZMSG_MAX_CHUNK);
+    zm->tail = msg_alloc(zm->chunk, &zm->tail_alloc);
+    if (IS_ERR(zm->tail)) {
+        void *err = zm->tail;
+
+        kfree(zm);
+        return err;
+    }
+
+    return zm;
+}
+
+/* Bytes of chunk idx. A compressed chunk is decompressed into *scratch,
+ * which is allocated on first use and kvfree()d by the caller.
+ */
+static const char *zmsg_chunk(const struct zmsg *zm, unsigned int idx, char **scratch)
+{
+    const struct zchunk *zc;
+
+    if (idx == zm->nr_chunks)
+        return zm->tail;
+
+    zc = &zm->chunks[idx];
+    if (!zc->zlen)
+        return zc->data;
+
+    if (!*scratch) {
+        *scratch = kvmalloc(zm->chunk, GFP_KERNEL);
+        if (!*scratch)
+            return ERR_PTR(-ENOMEM);
+    }
+    if (LZ4_decompress_safe(zc->data, *scratch, zc->zlen, zm->chunk) != zm->chunk)
+        return ERR_PTR(-EIO);
+
+    return *scratch;
+}
+
+/* Turn the full tail into the next chunk */
+static int zmsg_push(struct zmsg *zm)
+{
+    struct zchunk *zc;
+    int zlen;
+
+    if (zm->nr_chunks == zm->max_chunks) {
+        unsigned int max = zm->max_chunks ? 2 * zm->max_chunks : 16;
+        struct zchunk *chunks = kvmalloc_array(max, sizeof(*chunks), GFP_KERNEL_ACCOUNT);
+
+        if (!chunks)
+            return -ENOMEM;
+        if (zm->nr_chunks)
+            memcpy(chunks, zm->chunks, zm->nr_chunks * sizeof(*chunks));
+        kvfree(zm->chunks);
+        zm->chunks = chunks;
+        zm->max_chunks = max;
+    }
+
+    if (!lz4_wrkmem) {
+        lz4_wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+        lz4_out = kvmalloc(ZMSG_MAX_CHUNK, GFP_KERNEL);
+        if (!lz4_wrkmem || !lz4_out) {
+            kvfree(lz4_wrkmem);
+            kvfree(lz4_out);
+            lz4_wrkmem = NULL;
+            lz4_out = NULL;
+            return -ENOMEM;
+        }
+    }
+
+    /* Anything that does not save at least a byte is kept as is */
+    zlen = LZ4_compress_default(zm->tail, lz4_out, zm->chunk, zm->chunk - 1, lz4_wrkmem);
+
+    zc = &zm->chunks[zm->nr_chunks];
+    zc->zlen = zlen > 0 ? zlen : 0;
+    zc->data = msg_alloc(zc->zlen ? zc->zlen : zm->chunk, &zc->alloc);
+    if (IS_ERR(zc->data))
+        return PTR_ERR(zc->data);
+    memcpy(zc->data, zc->zlen ? lz4_out : zm->tail, zc->zlen ? zc->zlen : zm->chunk);
+
+    zm->nr_chunks++;
+    zm->stored += zc->alloc;
+    return 0;
+}
+
+/* Cut the message to pos bytes, pos <= zm->size */
+static int zmsg_truncate(struct zmsg *zm, size_t pos)
+{
+    unsigned int idx = pos / zm->chunk;
+    char *scratch = zm->tail;
+    const char *src;
+
+    if (idx < zm->nr_chunks) {
+        /* The chunk holding pos becomes the tail again */
+        if (pos % zm->chunk) {
+            src = zmsg_chunk(zm, idx, &scratch);
+            if (IS_ERR(src))
+                return PTR_ERR(src);
+            if (src != zm->tail)
+                memcpy(zm->tail, src, pos % zm->chunk);
+        }
+        while (zm->nr_chunks > idx) {
+            struct zchunk *zc = &zm->chunks[--zm->nr_chunks];
+
+            zm->stored -= zc->alloc;
+            msg_free(zc->data, zc->alloc);
+        }
+    }
+
+    zm->size = pos;
+    return 0;
+}
+
+/* Append everything in from, compressing each chunk as it fills. *crc is
+ * extended with the appended bytes.
+ */
+static int zmsg_append(struct zmsg *zm, struct iov_iter *from, u32 *crc)
+{
+    while (iov_iter_count(from)) {
+        size_t used = zm->size - (size_t)zm->nr_chunks * zm->chunk;
+        size_t n = min_t(size_t, iov_iter_count(from), zm->chunk - used);
+        int ret;
+
+        if (!copy_from_iter_full(zm->tail + used, n, from))
+            return -EFAULT;
+        *crc = crc32c(*crc, zm->tail + used, n);
+        zm->size += n;
+
+        if (used + n == zm->chunk) {
+            ret = zmsg_push(zm);
+            if (ret)
+                return ret;
+        }
+    }
+
+    return 0;
+}
+
+/* Copy length bytes from pos of a compressed message to to */
+static ssize_t zmsg_read_iter(const struct zmsg *zm, size_t pos, size_t length, struct iov_iter *to)
+{
+    char *scratch = NULL;
+    ssize_t done = 0;
+
+    while (length) {
+        size_t off = pos % zm->chunk;
+        size_t n = min_t(size_t, length, zm->chunk - off);
+        const char *src = zmsg_chunk(zm, pos / zm->chunk, &scratch);
+        size_t copied;
+
+        if (IS_ERR(src)) {
+            if (!done)
+                done = PTR_ERR(src);
+            break;
+        }
+
+        copied = copy_to_iter(src + off, n, to);
+        done += copied;
+        if (copied < n)
+            break;
+        pos += n;
+        length -= n;
+    }
+
+    kvfree(scratch);
+    return done;
+}
+
+/* Extend *crc with the first len bytes of a compressed message */
+static int zmsg_crc(const struct zmsg *zm, size_t len, u32 *crc)
+{
+    char *scratch = NULL;
+    size_t pos;
+    int ret = 0;
+
+    for (pos = 0; pos < len; pos += zm->chunk) {
+        const char *src = zmsg_chunk(zm, pos / zm->chunk, &scratch);
+
+        if (IS_ERR(src)) {
+            ret = PTR_ERR(src);
+            break;
+        }
+        *crc = crc32c(*crc, src, min_t(size_t, len - pos, zm->chunk));
+    }
+
+    kvfree(scratch);
+    return ret;
+}
+
+/* IOCTL_GET_MSG for a compressed message: all bytes plus the null */
+static int zmsg_copy_to_user(const struct zmsg *zm, char __user *user_buf)
+{
+    char *scratch = NULL;
+    size_t pos;
+    int ret = 0;
+
+    for (pos = 0; pos < zm->size && !ret; pos += zm->chunk) {
+        size_t n = min_t(size_t, zm->size - pos, zm->chunk);
+        const char *src = zmsg_chunk(zm, pos / zm->chunk, &scratch);
+
+        if (IS_ERR(src))
+            ret = PTR_ERR(src);
+        else if (copy_to_user(user_buf + pos, src, n))
+            ret = -EFAULT;
+    }
+    if (!ret && put_user('\0', user_buf + zm->size))
+        ret = -EFAULT;
+
+    kvfree(scratch);
+    return ret;
+}
+
+/* IOCTL_SEARCH in progress: matches go to out until max are stored */
+struct msg_search
+{
+    const u8 *pattern;
+    u32 pattern_len;
+    u64 __user *out;
+    u32 max;
+    u32 found;
+    u64 next;
+};
+
+/* memchr() a word at a time. The generic memchr() used on x86-64 compares
+ * byte by byte, and the scan is cheap enough that kernel_fpu_begin() and its
+ * FPU state save would not pay off for SIMD.
+ */
+static const char *find_byte(const char *p, const char *end, u8 c)
+{
+    const struct word_at_a_time constants = WORD_AT_A_TIME_CONSTANTS;
+    unsigned long pattern = REPEAT_BYTE(c);
+
+    for (; p < end && !IS_ALIGNED((unsigned long)p, sizeof(long)); p++)
+        if (*p == c)
+            return p;
+
+    for (; end - p >= sizeof(long); p += sizeof(long)) {
+        unsigned long data = *(const unsigned long *)p ^ pattern;
+        unsigned long bits;
+
+        if (has_zero(data, &bits, &constants)) {
+            bits = prep_zero_mask(data, bits, &constants);
+            return p + find_zero(create_zero_mask(bits));
+        }
+    }
+
+    for (; p < end; p++)
+        if (*p == c)
+            return p;
+
+    return NULL;
+}
+
+/* Report the matches that lie wholly in buf, which is at offset base of the
+ * message. Returns 1 once out holds max matches, with next at the first
+ * match left unreported.
+ */
+static int search_buf(struct msg_search *s, const char *buf, size_t len, size_t base)
+{
+    const char *p = buf, *end;
+
+    if (len < s->pattern_len)
+        return 0;
+    end = buf + len - s->pattern_len + 1;
+
+    for (; (p = find_byte(p, end, s->pattern[0])); p++) {
+        if (memcmp(p + 1, s->pattern + 1, s->pattern_len - 1))
+            continue;
+        if (s->found == s->max) {
+            s->next = base + (p - buf);
+            return 1;
+        }
+        if (put_user(base + (p - buf), s->out + s->found))
+            return -EFAULT;
+        s->found++;
+    }
+
+    return 0;
+}
+
+/* search_buf() over a compressed message from start on, one chunk at a time.
+ * The last pattern_len - 1 bytes of a chunk are carried over, so matches
+ * across a chunk boundary are found too.
+ */
+static int zmsg_search(const struct zmsg *zm, struct msg_search *s, size_t start)
+{
+    size_t off = start % zm->chunk, keep = 0, pos;
+    char *scratch = NULL, *win;
+    int ret = 0;
+
+    win = kvmalloc(zm->chunk + CHARDEV_SEARCH_MAX_PATTERN, GFP_KERNEL);
+    if (!win)
+        return -ENOMEM;
+
+    for (pos = start - off; pos < zm->size && !ret; pos += zm->chunk, off = 0) {
+        size_t n = min_t(size_t, zm->size - pos, zm->chunk) - off;
+        const char *src = zmsg_chunk(zm, pos / zm->chunk, &scratch);
+        size_t carry;
+
+        if (IS_ERR(src)) {
+            ret = PTR_ERR(src);
+            break;
+        }
+
+        memcpy(win + keep, src + off, n);
+        ret = search_buf(s, win, keep + n, pos + off - keep);
+
+        carry = min_t(size_t, keep + n, s->pattern_len - 1);
+        memmove(win, win + keep + n - carry, carry);
+        keep = carry;
+    }
+
+    kvfree(scratch);
+    kvfree(win);
+    return ret;
+}
+
+/* Free all replicas. Called with message_lock held for write, before message
+ * changes.
+ */
+static size_t message_drop_replicas(void)
+{
+    size_t freed = 0;
+    int nid;
+
+    for_each_online_node(nid) {
+        struct msg_replica *replica = message_replicas[nid];
+
+        if (!replica)
+            continue;
+        message_replicas[nid] = NULL;
+        freed += replica->alloc;
+        kvfree(replica);
+    }
+    atomic_long_sub(freed, &replica_bytes);
+    atomic_long_sub(freed, &message_bytes);
+
+    return freed;
+}
+
+/* Node holding the start of message, which needs no replica */
+static int message_nid(void)
+{
+    if (message_large)
+        return page_to_nid(message_large->chunks[0]);
+    if (is_vmalloc_addr(message))
+        return page_to_nid(vmalloc_to_page(message));
+    return page_to_nid(virt_to_page(message));
+}
+
+/* message, or its replica on the caller's node, made on first use. Called
+ * with message_lock held for read and message set. Falls back to message
+ * when there is no memory or the cap is reached.
+ */
+static const char *message_local_copy(void)
+{
+    int nid = numa_node_id();
+    struct msg_replica *replica = READ_ONCE(message_replicas[nid]);
+    size_t alloc;
+
+    if (replica)
+        return replica->data;
+    if (num_online_nodes() == 1 || nid == message_nid())
+        return message;
+
+    alloc = struct_size(replica, data, message_size + 1);
+    if (!msg_reserve(alloc))
+        return message;
+
+    replica = kvmalloc_node(alloc, GFP_KERNEL_ACCOUNT | __GFP_NOWARN, nid);
+    if (!replica) {
+        atomic_long_sub(alloc, &message_bytes);
+        return message;
+    }
+    replica->alloc = alloc;
+    memcpy(replica->data, message, message_size);
+    replica->data[message_size] = '\0';
+
+    /* Another reader on this node may have been faster */
+    if (cmpxchg(&message_replicas[nid], NULL, replica)) {
+        kvfree(replica);
+        atomic_long_sub(alloc, &message_bytes);
+        return READ_ONCE(message_replicas[nid])->data;
+    }
+    atomic_long_add(alloc, &replica_bytes);
+
+    return replica->data;
+}
 
-static struct class *cls = NULL;
+static unsigned long msg_shrink_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    size_t bytes = READ_ONCE(spare_bytes) + atomic_long_read(&replica_bytes);
+
+    return bytes ? DIV_ROUND_UP(bytes, PAGE_SIZE) : SHRINK_EMPTY;
+}
 
-/* Read from device */
-static ssize_t device_read(struct file *file, char __user *buffer, size_t length, loff_t *offset)
+static unsigned long msg_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc)
 {
-    ssize_t bytes_read = 0;
+    size_t want = sc->nr_to_scan << PAGE_SHIFT;
+    size_t freed = msg_drop_spares(want);
+
+    /* Replicas go next; never block on message_lock from reclaim */
+    if (freed < want && down_write_trylock(&message_lock)) {
+        freed += message_drop_replicas();
+        up_write(&message_lock);
+    }
+
+    return freed ? DIV_ROUND_UP(freed, PAGE_SIZE) : SHRINK_STOP;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 7, 0)
+static struct shrinker msg_shrinker_static = {
+    .count_objects = msg_shrink_count,
+    .scan_objects = msg_shrink_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+#endif
+
+static int msg_shrinker_register(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    msg_shrinker = shrinker_alloc(0, DEVICE_NAME "-msg");
+    if (!msg_shrinker)
+        return -ENOMEM;
+    msg_shrinker->count_objects = msg_shrink_count;
+    msg_shrinker->scan_objects = msg_shrink_scan;
+    shrinker_register(msg_shrinker);
+    return 0;
+#else
+    msg_shrinker = &msg_shrinker_static;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    return register_shrinker(msg_shrinker, DEVICE_NAME "-msg");
+#else
+    return register_shrinker(msg_shrinker);
+#endif
+#endif
+}
+
+static void msg_shrinker_unregister(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    shrinker_free(msg_shrinker);
+#else
+    unregister_shrinker(msg_shrinker);
+#endif
+}
+
+/* O_NONBLOCK on the file, or RWF_NOWAIT on this call */
+static bool iocb_nowait(const struct kiocb *iocb)
+{
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/* Dequeue one whole message. A message larger than the buffer stays queued and
+ * the call fails with -EMSGSIZE, like mq_receive().
+ */
+static ssize_t queue_read(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct queued_msg *msg;
+    size_t length;
+
+    down_write(&message_lock);
+    while (list_empty(&msg_queue)) {
+        up_write(&message_lock);
+
+        if (iocb_nowait(iocb))
+            return -EAGAIN;
+        if (wait_event_interruptible(queue_readq, READ_ONCE(queue_len) > 0))
+            return -ERESTARTSYS;
+
+        down_write(&message_lock);
+    }
+
+    msg = list_first_entry(&msg_queue, struct queued_msg, list);
+    if (iov_iter_count(to) < msg->size) {
+        up_write(&message_lock);
+        return -EMSGSIZE;
+    }
+    /* Copy before dequeuing so a fault does not lose the message */
+    if (copy_to_iter(msg->data, msg->size, to) != msg->size) {
+        up_write(&message_lock);
+        return -EFAULT;
+    }
+    list_del(&msg->list);
+    queue_len--;
+    up_write(&message_lock);
+
+    wake_up_interruptible_poll(&queue_writeq, EPOLLOUT | EPOLLWRNORM);
+
+    length = msg->size;
+    msg_free(msg, msg->alloc);
+    return length;
+}
 
-    if (!message || *offset >= message_size)
-        return 0; // EOF
+/* Enqueue one message, waiting for a free slot when the queue is full */
+static ssize_t queue_write(struct kiocb *iocb, struct iov_iter *from)
+{
+    size_t length = iov_iter_count(from);
+    struct queued_msg *msg;
+    size_t alloc;
 
-    if (length > message_size - *offset)
-        length = message_size - *offset;
+    msg = msg_alloc(struct_size(msg, data, length), &alloc);
+    if (IS_ERR(msg))
+        return PTR_ERR(msg);
+    msg->alloc = alloc;
 
-    if (copy_to_user(buffer, message + *offset, length))
+    /* writev() segments are gathered straight into the message */
+    if (!copy_from_iter_full(msg->data, length, from)) {
+        msg_free(msg, msg->alloc);
         return -EFAULT;
+    }
+    msg->size = length;
+
+    down_write(&message_lock);
+    while (queue_len >= queue_depth) {
+        up_write(&message_lock);
+
+        if (iocb_nowait(iocb)) {
+            msg_free(msg, msg->alloc);
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(queue_writeq, READ_ONCE(queue_len) < queue_depth)) {
+            msg_free(msg, msg->alloc);
+            return -ERESTARTSYS;
+        }
+
+        down_write(&message_lock);
+    }
+    list_add_tail(&msg->list, &msg_queue);
+    queue_len++;
+    up_write(&message_lock);
+
+    wake_up_interruptible_poll(&queue_readq, EPOLLIN | EPOLLRDNORM);
+
+    return length;
+}
+
+/* Read from device. Also serves splice() and sendfile() through
+ * copy_splice_read(), which hands us pipe pages to fill.
+ */
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    size_t length = iov_iter_count(to);
+    ssize_t bytes_read = 0;
+    const char *src;
+
+    if (queue_depth)
+        return queue_read(iocb, to);
+
+    down_read(&message_lock);
+
+    if ((!message && !message_z) || iocb->ki_pos >= message_size)
+        goto out; // EOF
 
-    *offset += length;
-    bytes_read = length;
+    if (length > message_size - iocb->ki_pos)
+        length = message_size - iocb->ki_pos;
 
-    pr_info("Read %zd bytes; %lld bytes left\n", bytes_read, message_size - *offset);
+    if (message_z) {
+        bytes_read = zmsg_read_iter(message_z, iocb->ki_pos, length, to);
+    } else {
+        src = READ_ONCE(numa_replicate) ? message_local_copy() : message;
+        bytes_read = copy_to_iter(src + iocb->ki_pos, length, to);
+    }
+    if (bytes_read <= 0) {
+        if (bytes_read == 0)
+            bytes_read = -EFAULT;
+        goto out;
+    }
+
+    iocb->ki_pos += bytes_read;
+
+    pr_info("Read %zd bytes; %lld bytes left\n", bytes_read, message_size - iocb->ki_pos);
 
+out:
+    up_read(&message_lock);
     return bytes_read;
 }
 
-/* Write to device */
-static ssize_t device_write(struct file *file, const char __user *buffer, size_t length, loff_t *offset)
+/* Running CRC32C of the first len bytes of the message */
+static int message_crc_prefix(size_t len, u32 *crc)
+{
+    *crc = ~0U;
+    if (message_z)
+        return zmsg_crc(message_z, len, crc);
+    if (len)
+        *crc = crc32c(*crc, message, len);
+    return 0;
+}
+
+/* Adopted pages can still change through other writers of the file they
+ * map, so their digest is not trusted. Called with message_lock held for
+ * read; returns with it held again, after catching up message_crc and
+ * message_gen if the bytes no longer match.
+ */
+static void message_check_pinned(void)
+{
+    if (!message_large || !message_large->pinned ||
+        crc32c(~0U, message, message_size) == message_crc)
+        return;
+
+    up_read(&message_lock);
+    down_write(&message_lock);
+    if (message_large && message_large->pinned) {
+        u32 crc = crc32c(~0U, message, message_size);
+
+        if (crc != message_crc) {
+            message_drop_replicas();
+            message_crc = crc;
+            message_gen++;
+        }
+    }
+    downgrade_write(&message_lock);
+}
+
+/* device_write_iter() for a compressed message, message_lock held for write.
+ * crc is the running CRC32C of the first pos bytes.
+ */
+static int message_write_z(size_t pos, struct iov_iter *from, u32 crc)
+{
+    struct zmsg *zm = message_z;
+    u32 new_crc = crc;
+    int ret;
+
+    if (pos == 0) {
+        zm = zmsg_alloc();
+        if (IS_ERR(zm))
+            return PTR_ERR(zm);
+    } else {
+        ret = zmsg_truncate(zm, pos);
+        if (ret)
+            return ret;
+    }
+
+    ret = zmsg_append(zm, from, &new_crc);
+    if (ret) {
+        if (zm != message_z) {
+            zmsg_free(zm);
+        } else {
+            zmsg_truncate(zm, pos); // drop the partially written tail
+            message_size = pos;
+            message_crc = crc;
+            message_gen++;
+        }
+        return ret;
+    }
+
+    if (zm != message_z) {
+        message_buf_free(message, message_alloc, message_large);
+        zmsg_free(message_z);
+        message = NULL;
+        message_alloc = 0;
+        message_large = NULL;
+        message_z = zm;
+    }
+    message_crc = new_crc;
+
+    return 0;
+}
+
+/* Write to device. A write at position 0 starts a new message, a write at
+ * position p keeps the first p bytes and appends, so consecutive write(),
+ * writev() or splice() calls on one open file build a single message.
+ */
+static ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
+    size_t length = iov_iter_count(from);
+    loff_t pos = iocb->ki_pos;
+    size_t new_size, new_alloc;
+    struct large_msg *new_large;
     char *new_msg;
+    ssize_t ret = length;
+    u32 crc;
 
     if (length == 0)
         return 0;
 
-    /* Allocate/reallocate buffer to hold new message */
-    new_msg = kmalloc(length + 1, GFP_KERNEL);
-    if (!new_msg)
-        return -ENOMEM;
+    if (queue_depth)
+        return queue_write(iocb, from);
 
-    if (copy_from_user(new_msg, buffer, length)) {
-        kfree(new_msg);
-        return -EFAULT;
+    down_write(&message_lock);
+
+    if (pos > message_size) {
+        ret = -EINVAL;
+        goto out;
+    }
+    new_size = pos + length;
+    message_drop_replicas();
+
+    /* An append extends the digest, anything else rehashes the kept bytes */
+    crc = message_crc;
+    if (pos != message_size) {
+        ret = message_crc_prefix(pos, &crc);
+        if (ret)
+            goto out;
+    }
+
+    /* The compress parameter is looked at when a new message starts; an
+     * append keeps the form of the message it extends
+     */
+    if (pos == 0 ? READ_ONCE(compress) : message_z != NULL) {
+        ret = message_write_z(pos, from, crc) ?: length;
+        if (ret < 0)
+            goto out;
+        goto stored;
+    }
+
+    new_msg = message;
+    new_alloc = message_alloc;
+    new_large = message_large;
+    /* A mapped large message is never changed in place. mmap() takes its
+     * reference under message_lock, so none can be added while we hold it.
+     */
+    if (pos == 0 || new_size + 1 > message_alloc ||
+        (message_large && kref_read(&message_large->ref) > 1)) {
+        /* Grow geometrically while appending to keep splice() linear: room
+         * for the next power of two of bytes plus the null, so a message
+         * that ends on a power of two fits without doubling again. A copy
+         * of a mapped message that still fits keeps its size.
+         */
+        if (!pos)
+            new_alloc = new_size + 1;
+        else if (new_size + 1 > message_alloc)
+            new_alloc = roundup_pow_of_two(new_size) + 1;
+        new_msg = message_buf_alloc(new_alloc, &new_alloc, &new_large);
+        if (IS_ERR(new_msg)) {
+            ret = PTR_ERR(new_msg);
+            goto out;
+        }
+        if (pos)
+            memcpy(new_msg, message, pos);
     }
 
-    new_msg[length] = '\0'; // Null terminate
+    /* writev() segments are gathered straight into the message */
+    if (!copy_from_iter_full(new_msg + pos, length, from)) {
+        if (new_msg != message) {
+            message_buf_free(new_msg, new_alloc, new_large);
+        } else {
+            message_size = pos; // drop the partially overwritten tail
+            message_crc = crc;
+            message_gen++;
+        }
+        ret = -EFAULT;
+        goto out;
+    }
+
+    new_msg[new_size] = '\0'; // Null terminate
+    message_crc = crc32c(crc, new_msg + pos, length);
+
+    if (new_msg != message) {
+        /* Free old message buffer, mappings keep a large one alive */
+        message_buf_free(message, message_alloc, message_large);
+        zmsg_free(message_z);
+        message_z = NULL;
+        message = new_msg;
+        message_alloc = new_alloc;
+        message_large = new_large;
+    }
 
-    /* Free old message buffer */
-    kfree(message);
-    message = new_msg;
-    message_size = length;
+stored:
+    message_size = new_size;
+    message_gen++;
+    iocb->ki_pos = new_size;
 
     pr_info("Written %zu bytes to device\n", length);
 
-    return length;
+out:
+    up_write(&message_lock);
+    return ret;
+}
+
+/* Replace the ring with a new, zeroed one whose data area is data_size bytes */
+static int ring_setup(unsigned long data_size)
+{
+    struct chardev_ring *new_ring;
+
+    if (data_size < PAGE_SIZE || data_size > CHARDEV_RING_MAX_SIZE || !is_power_of_2(data_size))
+        return -EINVAL;
+
+    /* vmalloc_user() zeroes the area and marks it as mappable to user space */
+    new_ring = vmalloc_user(CHARDEV_RING_DATA_OFFSET + data_size);
+    if (!new_ring)
+        return -ENOMEM;
+
+    new_ring->size = data_size;
+    new_ring->data_offset = CHARDEV_RING_DATA_OFFSET;
+
+    down_write(&message_lock);
+    if (atomic_read(&ring_users)) {
+        up_write(&message_lock);
+        vfree(new_ring);
+        return -EBUSY;
+    }
+    vfree(ring);
+    ring = new_ring;
+    ring_size = data_size;
+    up_write(&message_lock);
+
+    pr_info("Ring set up with %lu data bytes\n", data_size);
+
+    return 0;
+}
+
+/* need == 0: the ring holds a record. Otherwise: need bytes are free.
+ * head and tail live in user-writable memory, so they are only trusted as a
+ * wake-up condition.
+ */
+static bool ring_ready(const struct chardev_ring *r, u32 size, unsigned long need)
+{
+    u64 head = READ_ONCE(r->head);
+    u64 tail = READ_ONCE(r->tail);
+
+    if (need == 0)
+        return head != tail;
+
+    return head - tail <= size - need;
+}
+
+/* Sleep until ring_ready(). The producer and the consumer kick each other
+ * with IOCTL_RING_KICK, so this is the only system call on the data path.
+ */
+static int ring_wait(unsigned long need)
+{
+    struct chardev_ring *r;
+    u32 size;
+    int ret;
+
+    down_read(&message_lock);
+    r = ring;
+    size = ring_size;
+    if (r)
+        atomic_inc(&ring_users);
+    up_read(&message_lock);
+
+    if (!r)
+        return -ENODATA;
+
+    if (need > size)
+        ret = -EINVAL;
+    else
+        ret = wait_event_interruptible(ring_waitq, ring_ready(r, size, need));
+
+    atomic_dec(&ring_users);
+    return ret;
+}
+
+/* IOCTL_SEARCH: scan the message in place, only the offsets go to user space */
+static long message_search(struct chardev_search __user *user_req)
+{
+    struct chardev_search req;
+    struct msg_search s;
+    int ret = 0;
+
+    if (copy_from_user(&req, user_req, sizeof(req)))
+        return -EFAULT;
+    if (req.pattern_len == 0 || req.pattern_len > CHARDEV_SEARCH_MAX_PATTERN)
+        return -EINVAL;
+
+    s.pattern = req.pattern;
+    s.pattern_len = req.pattern_len;
+    s.out = u64_to_user_ptr(req.offsets);
+    s.max = req.max_offsets;
+    s.found = 0;
+
+    down_read(&message_lock);
+    s.next = message_size;
+    if (!message && !message_z)
+        ret = -ENODATA;
+    else if (req.start < message_size && message_z)
+        ret = zmsg_search(message_z, &s, req.start);
+    else if (req.start < message_size)
+        ret = search_buf(&s, message + req.start, message_size - req.start, req.start);
+    up_read(&message_lock);
+    if (ret < 0)
+        return ret;
+
+    req.found = s.found;
+    req.next = s.next;
+    if (copy_to_user(user_req, &req, sizeof(req)))
+        return -EFAULT;
+
+    return 0;
 }
 
 /* ioctl handler */
@@ -95,7 +1491,8 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num, unsigned lon
     {
         char __user *user_msg = (char __user *)ioctl_param;
         char *kbuf;
-        size_t len;
+        size_t len, alloc;
+        u32 crc;
 
         if (!user_msg)
             return -EINVAL;
@@ -105,25 +1502,69 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num, unsigned lon
         if (len == 0 || len > 1024)
             return -EINVAL;
 
-        kbuf = kmalloc(len, GFP_KERNEL);
-        if (!kbuf)
-            return -ENOMEM;
+        kbuf = msg_alloc(len, &alloc);
+        if (IS_ERR(kbuf))
+            return PTR_ERR(kbuf);
 
         if (copy_from_user(kbuf, user_msg, len)) {
-            kfree(kbuf);
+            msg_free(kbuf, alloc);
             return -EFAULT;
         }
+        crc = crc32c(~0U, kbuf, len - 1);
 
         /* Free old message */
-        kfree(message);
+        down_write(&message_lock);
+        message_drop_replicas();
+        message_buf_free(message, message_alloc, message_large);
+        zmsg_free(message_z);
 
         message = kbuf;
+        message_z = NULL;
+        message_large = NULL;
         message_size = len - 1; // exclude terminating null from strnlen_user
+        message_alloc = alloc;
+        message_crc = crc;
+        message_gen++;
+        up_write(&message_lock);
 
         pr_info("IOCTL: Set message of size %zu\n", message_size);
 
         break;
     }
+    case IOCTL_SET_MSG_PAGES:
+    {
+        struct chardev_msg_pages req;
+        struct large_msg *lm;
+        u32 crc;
+
+        if (copy_from_user(&req, (void __user *)ioctl_param, sizeof(req)))
+            return -EFAULT;
+        if (req.len == 0 || req.len > MAX_RW_COUNT)
+            return -EINVAL;
+
+        lm = large_msg_pin(req.addr, req.len);
+        if (IS_ERR(lm))
+            return PTR_ERR(lm);
+        crc = crc32c(~0U, lm->vaddr + offset_in_page(req.addr), req.len);
+
+        down_write(&message_lock);
+        message_drop_replicas();
+        message_buf_free(message, message_alloc, message_large);
+        zmsg_free(message_z);
+
+        message = lm->vaddr + offset_in_page(req.addr);
+        message_z = NULL;
+        message_large = lm;
+        message_size = req.len;
+        message_alloc = 0; // the pages are not ours: a later write copies first
+        message_crc = crc;
+        message_gen++;
+        up_write(&message_lock);
+
+        pr_info("IOCTL: Adopted %zu bytes of user pages as message\n", message_size);
+
+        break;
+    }
     case IOCTL_GET_MSG:
     {
         /* ioctl_param is a user pointer to buffer where we copy message */
@@ -132,22 +1573,88 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num, unsigned lon
         if (!user_buf)
             return -EINVAL;
 
-        if (message == NULL)
-            return -ENODATA;
-
-        if (copy_to_user(user_buf, message, message_size + 1))
-            return -EFAULT;
+        down_read(&message_lock);
+        if (message_z)
+            ret = zmsg_copy_to_user(message_z, user_buf);
+        else if (message == NULL)
+            ret = -ENODATA;
+        else if (copy_to_user(user_buf, message, message_size) ||
+                 put_user('\0', user_buf + message_size))
+            ret = -EFAULT; // adopted pages carry no null, so add one here
+        up_read(&message_lock);
+        if (ret)
+            return ret;
 
         pr_info("IOCTL: Get message\n");
         break;
     }
     case IOCTL_GET_NTH_BYTE:
-        if (ioctl_param >= message_size)
+        down_read(&message_lock);
+        if (ioctl_param >= message_size) {
             ret = -EINVAL;
-        else if (message)
+        } else if (message) {
             ret = (long)message[ioctl_param];
-        else
+        } else if (message_z) {
+            char *scratch = NULL;
+            const char *src = zmsg_chunk(message_z, ioctl_param / message_z->chunk, &scratch);
+
+            ret = IS_ERR(src) ? PTR_ERR(src) : (long)src[ioctl_param % message_z->chunk];
+            kvfree(scratch);
+        } else {
             ret = -ENODATA;
+        }
+        up_read(&message_lock);
+        break;
+    case IOCTL_GET_MSG_STAT:
+    {
+        struct chardev_msg_stat stat = {};
+
+        down_read(&message_lock);
+        stat.size = message_size;
+        if (message_z) {
+            stat.stored = message_z->stored + message_z->tail_alloc;
+            stat.chunk_bytes = message_z->chunk;
+            stat.chunks = message_z->nr_chunks;
+        } else if (message) {
+            stat.stored = message_alloc;
+        }
+        up_read(&message_lock);
+
+        if (copy_to_user((void __user *)ioctl_param, &stat, sizeof(stat)))
+            return -EFAULT;
+        break;
+    }
+    case IOCTL_GET_DIGEST:
+    {
+        struct chardev_digest digest = {};
+
+        down_read(&message_lock);
+        message_check_pinned();
+        digest.generation = message_gen;
+        digest.size = message_size;
+        digest.crc32c = ~message_crc;
+        up_read(&message_lock);
+
+        if (copy_to_user((void __user *)ioctl_param, &digest, sizeof(digest)))
+            return -EFAULT;
+        break;
+    }
+    case IOCTL_SEARCH:
+        ret = message_search((struct chardev_search __user *)ioctl_param);
+        break;
+    case IOCTL_RING_SETUP:
+        ret = ring_setup(ioctl_param);
+        break;
+    case IOCTL_RING_KICK:
+        wake_up_interruptible(&ring_waitq);
+        break;
+    case IOCTL_RING_WAIT_DATA:
+        ret = ring_wait(0);
+        break;
+    case IOCTL_RING_WAIT_SPACE:
+        if (ioctl_param == 0)
+            return -EINVAL;
+        ret = ring_wait(ioctl_param);
         break;
     default:
         ret = -ENOTTY;
@@ -157,10 +1664,204 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num, unsigned lon
     return ret;
 }
 
+/* Keep the ring alive while it is mapped, also across fork() and VMA splits */
+static void ring_vma_open(struct vm_area_struct *vma)
+{
+    atomic_inc(&ring_users);
+}
+
+static void ring_vma_close(struct vm_area_struct *vma)
+{
+    atomic_dec(&ring_users);
+}
+
+static const struct vm_operations_struct ring_vm_ops = {
+    .open = ring_vma_open,
+    .close = ring_vma_close,
+};
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+static inline void vm_flags_set(struct vm_area_struct *vma, vm_flags_t flags)
+{
+    vma->vm_flags |= flags;
+}
+
+static inline void vm_flags_clear(struct vm_area_struct *vma, vm_flags_t flags)
+{
+    vma->vm_flags &= ~flags;
+}
+#endif
+
+#define MESSAGE_PGOFF (CHARDEV_MMAP_MESSAGE >> PAGE_SHIFT)
+
+/* Page frame backing page index of a large message */
+static unsigned long large_msg_pfn(const struct large_msg *lm, pgoff_t index)
+{
+    return page_to_pfn(lm->chunks[index >> lm->order]) + (index & ((1UL << lm->order) - 1));
+}
+
+static void message_vma_open(struct vm_area_struct *vma)
+{
+    struct large_msg *lm = vma->vm_private_data;
+
+    kref_get(&lm->ref);
+}
+
+static void message_vma_close(struct vm_area_struct *vma)
+{
+    struct large_msg *lm = vma->vm_private_data;
+
+    kref_put(&lm->ref, large_msg_release);
+}
+
+static vm_fault_t message_vma_fault(struct vm_fault *vmf)
+{
+    struct large_msg *lm = vmf->vma->vm_private_data;
+    pgoff_t index = vmf->pgoff - MESSAGE_PGOFF;
+
+    if (index >= lm->alloc >> PAGE_SHIFT)
+        return VM_FAULT_SIGBUS;
+
+    return vmf_insert_pfn(vmf->vma, vmf->address, large_msg_pfn(lm, index));
+}
+
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+/* Map a whole PMD sized chunk at once, or let the core fall back to PTEs */
+static vm_fault_t message_vma_fault_pmd(struct vm_fault *vmf)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct large_msg *lm = vma->vm_private_data;
+    unsigned long addr = vmf->address & PMD_MASK;
+    pgoff_t index = vmf->pgoff - MESSAGE_PGOFF - ((vmf->address - addr) >> PAGE_SHIFT);
+    unsigned long pfn;
+
+    if (lm->order < PMD_PAGE_ORDER || addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end)
+        return VM_FAULT_FALLBACK;
+    if (!IS_ALIGNED(index, 1UL << PMD_PAGE_ORDER) ||
+        index + (1UL << PMD_PAGE_ORDER) > lm->alloc >> PAGE_SHIFT)
+        return VM_FAULT_FALLBACK;
+
+    pfn = large_msg_pfn(lm, index);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+    return vmf_insert_pfn_pmd(vmf, pfn, false);
+#else
+    return vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(pfn), false);
+#endif
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+static vm_fault_t message_vma_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+    return order == PMD_PAGE_ORDER ? message_vma_fault_pmd(vmf) : VM_FAULT_FALLBACK;
+}
+#else
+static vm_fault_t message_vma_huge_fault(struct vm_fault *vmf, enum page_entry_size pe_size)
+{
+    return pe_size == PE_SIZE_PMD ? message_vma_fault_pmd(vmf) : VM_FAULT_FALLBACK;
+}
+#endif
+#endif
+
+static const struct vm_operations_struct message_vm_ops = {
+    .open = message_vma_open,
+    .close = message_vma_close,
+    .fault = message_vma_fault,
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+    .huge_fault = message_vma_huge_fault,
+#endif
+};
+
+/* Map the current large message read-only. The mapping keeps that message
+ * alive after it is replaced; it does not follow later writes, since
+ * device_write_iter() copies a mapped message instead of appending in place.
+ */
+static int message_mmap(struct vm_area_struct *vma)
+{
+    pgoff_t first = vma->vm_pgoff - MESSAGE_PGOFF;
+    struct large_msg *lm;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EACCES;
+
+    /* Adopted user pages are not offered: the owner has them mapped already */
+    down_read(&message_lock);
+    lm = message_large;
+    if (lm && !lm->pinned)
+        kref_get(&lm->ref);
+    else
+        lm = NULL;
+    up_read(&message_lock);
+
+    if (!lm)
+        return -ENODATA;
+
+    if (first + vma_pages(vma) > lm->alloc >> PAGE_SHIFT) {
+        kref_put(&lm->ref, large_msg_release);
+        return -EINVAL;
+    }
+
+    vma->vm_private_data = lm;
+    vma->vm_ops = &message_vm_ops;
+    /* Raw PFNs pinned by our reference; VM_HUGEPAGE lets the THP "madvise"
+     * policy use huge_fault.
+     */
+    vm_flags_set(vma, VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP | VM_HUGEPAGE);
+    vm_flags_clear(vma, VM_MAYWRITE);
+
+    return 0;
+}
+
+/* Map the ring set up by IOCTL_RING_SETUP, or a large message */
+static int device_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    int ret;
+
+    if (vma->vm_pgoff >= MESSAGE_PGOFF)
+        return message_mmap(vma);
+
+    down_read(&message_lock);
+    if (!ring) {
+        ret = -ENODATA;
+    } else {
+        /* Fails if the VMA is larger than the ring */
+        ret = remap_vmalloc_range(vma, ring, vma->vm_pgoff);
+        if (!ret) {
+            vma->vm_ops = &ring_vm_ops;
+            atomic_inc(&ring_users);
+        }
+    }
+    up_read(&message_lock);
+
+    return ret;
+}
+
+/* In queue mode, readable while a message is queued and writable while a slot
+ * is free. A single message can always be read and overwritten.
+ */
+static __poll_t device_poll(struct file *file, poll_table *wait)
+{
+    __poll_t mask = 0;
+
+    if (!queue_depth)
+        return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(file, &queue_readq, wait);
+    poll_wait(file, &queue_writeq, wait);
+
+    down_read(&message_lock);
+    if (queue_len > 0)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (queue_len < queue_depth)
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    up_read(&message_lock);
+
+    return mask;
+}
+
 /* Device open */
 static int device_open(struct inode *inode, struct file *file)
 {
-    if (atomic_cmpxchg(&already_open, CDEV_NOT_USED, CDEV_EXCLUSIVE_OPEN))
+    if (exclusive && atomic_cmpxchg(&already_open, CDEV_NOT_USED, CDEV_EXCLUSIVE_OPEN))
         return -EBUSY;
 
     try_module_get(THIS_MODULE);
@@ -171,7 +1872,8 @@ static int device_open(struct inode *inode, struct file *file)
 /* Device release */
 static int device_release(struct inode *inode, struct file *file)
 {
-    atomic_set(&already_open, CDEV_NOT_USED);
+    if (exclusive)
+        atomic_set(&already_open, CDEV_NOT_USED);
     module_put(THIS_MODULE);
     pr_info("device_release()\n");
     return 0;
@@ -179,9 +1881,21 @@ static int device_release(struct inode *inode, struct file *file)
 
 static const struct file_operations fops = {
     .owner = THIS_MODULE,
-    .read = device_read,
-    .write = device_write,
+    .read_iter = device_read_iter,
+    .write_iter = device_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
+    .poll = device_poll,
     .unlocked_ioctl = device_ioctl,
+    .mmap = device_mmap,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    /* PMD aligned addresses, so large message chunks can be mapped huge */
+    .get_unmapped_area = thp_get_unmapped_area,
+#endif
     .open = device_open,
     .release = device_release,
 };
@@ -191,6 +1905,8 @@ static int major_num;
 /* Module init */
 static int __init chardev_init(void)
 {
+    int ret;
+
     major_num = register_chrdev(0, DEVICE_NAME, &fops);
     if (major_num < 0) {
         pr_err("Failed to register character device\n");
@@ -215,6 +1931,15 @@ static int __init chardev_init(void)
         return -ENOMEM;
     }
 
+    ret = msg_shrinker_register();
+    if (ret) {
+        device_destroy(cls, MKDEV(major_num, 0));
+        class_destroy(cls);
+        unregister_chrdev(major_num, DEVICE_NAME);
+        pr_err("Failed to register shrinker\n");
+        return ret;
+    }
+
     pr_info("Device registered with major number %d\n", major_num);
 
     return 0;
@@ -223,12 +1948,23 @@ static int __init chardev_init(void)
 /* Module exit */
 static void __exit chardev_exit(void)
 {
+    struct queued_msg *msg, *tmp;
+
     device_destroy(cls, MKDEV(major_num, 0));
     class_destroy(cls);
     unregister_chrdev(major_num, DEVICE_NAME);
+    msg_shrinker_unregister();
 
-    /* Free allocated message */
-    kfree(message);
+    /* Free allocated message, its replicas, ring and queued messages */
+    message_drop_replicas();
+    message_buf_free(message, message_alloc, message_large);
+    zmsg_free(message_z);
+    kvfree(lz4_wrkmem);
+    kvfree(lz4_out);
+    vfree(ring);
+    list_for_each_entry_safe(msg, tmp, &msg_queue, list)
+        msg_free(msg, msg->alloc);
+    msg_drop_spares(SIZE_MAX);
 
     pr_info("Device unregistered\n");
 }
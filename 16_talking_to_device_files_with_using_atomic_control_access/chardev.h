@@ -10,6 +10,7 @@
 #define CHARDEV_H
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 /*
  * The major device number. We can not rely on dynamic registration
@@ -45,6 +46,150 @@
  * a number, n, and returns message[n].
  */
 
+/* Allocate the shared ring with a data area of the given size in bytes, which
+ * must be a power of two. Like IOCTL_GET_NTH_BYTE, the size is passed by
+ * value. The ring is then mapped with mmap() at offset 0.
+ */
+#define IOCTL_RING_SETUP _IOW(MAJOR_NUM, 3, int)
+
+/* Wake whoever sleeps in IOCTL_RING_WAIT_DATA or IOCTL_RING_WAIT_SPACE. Only
+ * needed when the other side advertised it is waiting, see struct chardev_ring.
+ */
+#define IOCTL_RING_KICK _IO(MAJOR_NUM, 4)
+
+/* Consumer side: sleep until the ring holds at least one record */
+#define IOCTL_RING_WAIT_DATA _IO(MAJOR_NUM, 5)
+
+/* Producer side: sleep until the ring has room for the given number of bytes,
+ * passed by value.
+ */
+#define IOCTL_RING_WAIT_SPACE _IOW(MAJOR_NUM, 6, int)
+
+/* Report how the current message is stored, see struct chardev_msg_stat */
+#define IOCTL_GET_MSG_STAT _IOR(MAJOR_NUM, 7, struct chardev_msg_stat)
+
+struct chardev_msg_stat
+{
+    __u64 size;        /* message bytes, as read back */
+    __u64 stored;      /* bytes of memory holding them */
+    __u32 chunk_bytes; /* uncompressed bytes per chunk, 0 if not compressed */
+    __u32 chunks;      /* full chunks, the rest is kept uncompressed */
+};
+
+/* Make a user buffer the message without copying it, see
+ * struct chardev_msg_pages. Unlike IOCTL_SET_MSG there is no 1024 byte limit
+ * and no terminating null is needed.
+ */
+#define IOCTL_SET_MSG_PAGES _IOW(MAJOR_NUM, 8, struct chardev_msg_pages)
+
+/* The driver pins the pages of [addr, addr + len) and reads them in place
+ * until the message is replaced. So that they can't change under readers,
+ * the whole range must be mapped without PROT_WRITE and without a way to
+ * mprotect() it writable, or the ioctl fails with EACCES: map a memfd sealed
+ * with F_SEAL_WRITE and F_SEAL_FUTURE_WRITE, or a file opened read-only that
+ * nobody writes to, with MAP_SHARED. Unmapping it is fine, the pinned pages
+ * stay with the driver.
+ */
+struct chardev_msg_pages
+{
+    __u64 addr;
+    __u64 len;
+};
+
+/* Find a byte or a short pattern in the message, see struct chardev_search */
+#define IOCTL_SEARCH _IOWR(MAJOR_NUM, 9, struct chardev_search)
+
+#define CHARDEV_SEARCH_MAX_PATTERN 32
+
+/* Offsets of the matches at or after start are stored to offsets, in
+ * ascending order, until max_offsets are found. next is then the offset of
+ * the first match not stored, to pass as start of the following call, or the
+ * message size when there are no more. max_offsets = 0 just finds the next
+ * match. Matches may overlap.
+ */
+struct chardev_search
+{
+    __u64 start;       /* in: first offset to look at */
+    __u64 offsets;     /* in: user pointer to an array of __u64 */
+    __u64 next;        /* out: where to continue */
+    __u32 max_offsets; /* in: room in offsets */
+    __u32 found;       /* out: offsets stored */
+    __u32 pattern_len; /* in: 1 to CHARDEV_SEARCH_MAX_PATTERN */
+    __u32 reserved;
+    __u8 pattern[CHARDEV_SEARCH_MAX_PATTERN];
+};
+
+/* Get the digest of the message, see struct chardev_digest */
+#define IOCTL_GET_DIGEST _IOR(MAJOR_NUM, 10, struct chardev_digest)
+
+/* crc32c is the standard CRC-32C (Castagnoli) of the size message bytes, as
+ * computed by iSCSI or ext4, without the terminating null. generation changes
+ * whenever the message does, so a client that saw the same generation before
+ * knows the message is unchanged without hashing it again. For pages adopted
+ * with IOCTL_SET_MSG_PAGES the driver hashes them again on every call and
+ * moves generation on if they changed.
+ */
+struct chardev_digest
+{
+    __u64 generation;
+    __u64 size;
+    __u32 crc32c;
+    __u32 reserved;
+};
+
+/*
+ * Layout of the single-producer/single-consumer ring shared through mmap().
+ *
+ * head and tail are free running byte counters; the position in the data
+ * area is the counter masked with (size - 1). Each of them lives on its own
+ * cacheline together with the waiting flag of the same side, so the producer
+ * and the consumer never store to the same line.
+ *
+ * Records are pushed with plain stores: write the payload, then publish the
+ * new head with a release store. Before sleeping, a side sets its waiting
+ * flag, issues a full barrier and re-checks the ring; after publishing, the
+ * other side issues a full barrier and only calls IOCTL_RING_KICK when the
+ * flag is set. The kernel never touches the data area.
+ */
+#define CHARDEV_CACHELINE 64
+#define CHARDEV_RING_DATA_OFFSET 4096
+#define CHARDEV_RING_MAX_SIZE (64 << 20)
+
+struct chardev_ring
+{
+    /* Set by the driver, read-only afterwards */
+    __u32 size;        /* bytes in the data area, a power of two */
+    __u32 data_offset; /* start of the data area in the mapping */
+
+    /* Written by the producer only */
+    __u64 head __attribute__((aligned(CHARDEV_CACHELINE)));
+    __u32 producer_waiting;
+
+    /* Written by the consumer only */
+    __u64 tail __attribute__((aligned(CHARDEV_CACHELINE)));
+    __u32 consumer_waiting;
+} __attribute__((aligned(CHARDEV_CACHELINE)));
+
+/* Every record starts 8-byte aligned with this header. A record that would
+ * straddle the end of the data area is replaced by a CHARDEV_RING_PAD record
+ * that tells the consumer to skip to the start.
+ */
+struct chardev_ring_record
+{
+    __u32 len; /* payload bytes, or CHARDEV_RING_PAD */
+    __u32 reserved;
+};
+
+#define CHARDEV_RING_PAD 0xffffffffu
+#define CHARDEV_RING_ALIGN 8
+
+/* mmap() offset of the current message, once it is at least large_msg_bytes
+ * long. The mapping is read-only and keeps showing the message that was
+ * current at mmap() time: later writes, appends included, go to a new copy.
+ * Offsets below it map the ring.
+ */
+#define CHARDEV_MMAP_MESSAGE 0x40000000UL
+
 #define DEVICE_FILE_NAME "char_dev"
 #define DEVICE_PATH "/dev/char_dev"
 
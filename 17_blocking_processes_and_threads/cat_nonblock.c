@@ -1,10 +1,13 @@
 /* cat_nonblock.c - open a file and display its contents, but exit rather than wait for input.
+ * Given a wait file such as /proc/sleep_wait, it instead poll()s that file
+ * until the open may succeed and retries, without ever blocking in open().
  */
 #include <errno.h>  /* for errno */
 #include <fcntl.h>  /* for open */
 #include <stdio.h>  /* standard I/O */
 #include <stdlib.h> /* for exit */
 #include <unistd.h> /* for read */
+#include <poll.h>   /* for poll */
 #include <sys/types.h>
 #include <sys/stat.h>
 extern int errno;
@@ -17,15 +20,37 @@ int main(int argc, char *argv[])
     size_t bytes;           /* The number of bytes read */
     char buffer[MAX_BYTES]; /* The buffer for the bytes */
     /* Usage */
-    if (argc != 2)
+    if (argc != 2 && argc != 3)
     {
-        printf("Usage: %s <filename>\n", argv[0]);
+        printf("Usage: %s <filename> [wait_filename]\n", argv[0]);
         puts("Reads the content of a file, but doesn't wait for input");
         exit(EXIT_FAILURE);
     }
 
     /* Open the file for reading in non blocking mode */
     fd = open(argv[1], O_RDONLY | O_NONBLOCK);
+    if (fd == -1 && errno == EAGAIN && argc == 3)
+    {
+        /* Sleep in poll() until a reader may get in, then try again */
+        struct pollfd pfd = {.events = POLLIN};
+
+        pfd.fd = open(argv[2], O_RDONLY);
+        if (pfd.fd == -1)
+        {
+            puts("Open of the wait file failed");
+            exit(EXIT_FAILURE);
+        }
+        while (fd == -1 && errno == EAGAIN)
+        {
+            if (poll(&pfd, 1, -1) == -1)
+            {
+                puts("Poll failed");
+                exit(EXIT_FAILURE);
+            }
+            fd = open(argv[1], O_RDONLY | O_NONBLOCK);
+        }
+        close(pfd.fd);
+    }
     /* If open failed */
     if (fd == -1)
     {
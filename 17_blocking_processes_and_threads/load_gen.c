@@ -0,0 +1,270 @@
+/*
+ * load_gen.c - fork workers that open, read and close /proc/sleep as fast as
+ * they can, and report admission latency, throughput and fairness.
+ *
+ * Each worker gets the file in one of three ways:
+ *   block - a plain open(), sleeping in the module until admitted
+ *   retry - open() with O_NONBLOCK, yielding and trying again on EAGAIN
+ *   poll  - open() with O_NONBLOCK, poll()ing /proc/sleep_wait on EAGAIN
+ * It then keeps the file for hold_us, reading it (or writing it, for the
+ * given percentage of opens), and closes it. Admission latency is the time
+ * from the first open() attempt until one succeeds.
+ *
+ * Fairness is Jain's index over the opens each worker got: 1.0 when all got
+ * the same, 1/workers when one got them all.
+ *
+ * Build: gcc -O2 -o load_gen load_gen.c
+ * Usage: ./load_gen <block|retry|poll> [workers] [seconds] [hold_us] [write_percent]
+ */
+
+#include <errno.h>     /* for errno */
+#include <fcntl.h>     /* for open */
+#include <poll.h>      /* for poll */
+#include <sched.h>     /* for sched_yield */
+#include <stdio.h>     /* standard I/O */
+#include <stdlib.h>    /* for exit, strtoul */
+#include <string.h>    /* for strcmp */
+#include <time.h>      /* for clock_gettime */
+#include <unistd.h>    /* for fork, read, write */
+#include <sys/mman.h>  /* for mmap */
+#include <sys/wait.h>  /* for wait */
+
+#define PROC_FILE "/proc/sleep"
+#define WAIT_FILE "/proc/sleep_wait"
+
+/* Admission latency is counted per power of two of ns: waits range from
+ * microseconds to the length of a lease, and a factor of two is enough to
+ * tell the modes apart.
+ */
+#define LAT_BUCKETS 64
+
+enum mode
+{
+    MODE_BLOCK,
+    MODE_RETRY,
+    MODE_POLL,
+};
+
+/* One per worker, in memory shared with the parent */
+struct result
+{
+    unsigned long opens;
+    unsigned long retries;
+    unsigned long long lat_max;
+    unsigned long lat[LAT_BUCKETS];
+    int failed;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Bucket b holds latencies below 2^b ns and at least 2^(b-1); the last
+ * one also takes the centuries beyond
+ */
+static unsigned int lat_bucket(unsigned long long ns)
+{
+    unsigned int b = ns ? 64 - __builtin_clzll(ns) : 0;
+
+    return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+/* Upper bound in us of the latency of fraction q of the n samples in lat */
+static double lat_percentile(const unsigned long *lat, unsigned long n, double q)
+{
+    unsigned long rank = (unsigned long)(q * n), seen = 0;
+    unsigned int b;
+
+    for (b = 0; b < LAT_BUCKETS - 1; b++)
+    {
+        seen += lat[b];
+        if (seen > rank)
+            break;
+    }
+    return n ? (double)(1ULL << b) / 1e3 : 0;
+}
+
+/* Get the file the way mode says; returns the fd or -1 */
+static int acquire(enum mode mode, int write, int wait_fd, struct result *r)
+{
+    int flags = write ? O_RDWR : O_RDONLY;
+    struct pollfd pfd = {.fd = wait_fd, .events = write ? POLLOUT : POLLIN};
+    int fd;
+
+    if (mode == MODE_BLOCK)
+        return open(PROC_FILE, flags);
+
+    while ((fd = open(PROC_FILE, flags | O_NONBLOCK)) == -1 && errno == EAGAIN)
+    {
+        r->retries++;
+        if (mode == MODE_RETRY)
+            sched_yield();
+        else if (poll(&pfd, 1, -1) == -1)
+            return -1;
+    }
+    return fd;
+}
+
+static void worker(int id, enum mode mode, unsigned long long deadline, unsigned int hold_us,
+                   unsigned int write_percent, struct result *r)
+{
+    unsigned int seed = id * 2654435761u + 1;
+    char buffer[256];
+    int wait_fd = -1;
+
+    if (mode == MODE_POLL)
+    {
+        wait_fd = open(WAIT_FILE, O_RDONLY);
+        if (wait_fd == -1)
+        {
+            perror("Open of the wait file failed");
+            r->failed = 1;
+            return;
+        }
+    }
+
+    while (now_ns() < deadline)
+    {
+        unsigned long long t0, t1;
+        int write_op, fd;
+
+        seed = seed * 1103515245u + 12345u;
+        write_op = (seed >> 8) % 100 < write_percent;
+
+        t0 = now_ns();
+        fd = acquire(mode, write_op, wait_fd, r);
+        if (fd == -1)
+        {
+            perror("Open failed");
+            r->failed = 1;
+            break;
+        }
+        t1 = now_ns();
+        r->lat[lat_bucket(t1 - t0)]++;
+        if (t1 - t0 > r->lat_max)
+            r->lat_max = t1 - t0;
+        r->opens++;
+
+        if (write_op)
+        {
+            int len = snprintf(buffer, sizeof(buffer), "worker %d", id);
+
+            if (write(fd, buffer, len) == -1)
+                r->failed = 1;
+        }
+        else if (read(fd, buffer, sizeof(buffer)) == -1)
+        {
+            r->failed = 1;
+        }
+        if (hold_us)
+            usleep(hold_us);
+        close(fd);
+        if (r->failed)
+        {
+            perror("I/O failed");
+            break;
+        }
+    }
+
+    if (wait_fd != -1)
+        close(wait_fd);
+}
+
+int main(int argc, char *argv[])
+{
+    static unsigned long lat[LAT_BUCKETS];
+    static const char *const mode_names[] = {"block", "retry", "poll"};
+    enum mode mode;
+    int workers = argc > 2 ? (int)strtoul(argv[2], NULL, 0) : 8;
+    double seconds = argc > 3 ? strtod(argv[3], NULL) : 5;
+    unsigned int hold_us = argc > 4 ? strtoul(argv[4], NULL, 0) : 100;
+    unsigned int write_percent = argc > 5 ? strtoul(argv[5], NULL, 0) : 0;
+    unsigned long long start, deadline, lat_max = 0;
+    unsigned long opens = 0, retries = 0;
+    double sum_sq = 0, elapsed, jain;
+    struct result *results;
+    size_t map_size;
+    int i, b, ret = 0;
+
+    if (argc < 2 || workers < 1)
+    {
+        printf("Usage: %s <block|retry|poll> [workers] [seconds] [hold_us] [write_percent]\n",
+               argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    for (mode = MODE_BLOCK; mode <= MODE_POLL; mode++)
+        if (!strcmp(argv[1], mode_names[mode]))
+            break;
+    if (mode > MODE_POLL)
+    {
+        printf("Unknown mode %s\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    map_size = workers * sizeof(*results);
+    results = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED)
+    {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+
+    start = now_ns();
+    deadline = start + (unsigned long long)(seconds * 1e9);
+    for (i = 0; i < workers; i++)
+    {
+        pid_t pid = fork();
+
+        if (pid == -1)
+        {
+            perror("fork failed");
+            workers = i;
+            ret = 1;
+            break;
+        }
+        if (pid == 0)
+        {
+            worker(i, mode, deadline, hold_us, write_percent, &results[i]);
+            _exit(results[i].failed ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+    }
+    for (i = 0; i < workers; i++)
+    {
+        int status;
+
+        if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+            ret = 1;
+    }
+    elapsed = (now_ns() - start) / 1e9;
+
+    printf("worker,opens,retries,p50_us,p99_us,max_us\n");
+    for (i = 0; i < workers; i++)
+    {
+        struct result *r = &results[i];
+
+        printf("%d,%lu,%lu,%.2f,%.2f,%.2f\n", i, r->opens, r->retries,
+               lat_percentile(r->lat, r->opens, 0.5), lat_percentile(r->lat, r->opens, 0.99),
+               r->lat_max / 1e3);
+        opens += r->opens;
+        retries += r->retries;
+        sum_sq += (double)r->opens * r->opens;
+        if (r->lat_max > lat_max)
+            lat_max = r->lat_max;
+        for (b = 0; b < LAT_BUCKETS; b++)
+            lat[b] += r->lat[b];
+    }
+
+    jain = sum_sq ? (double)opens * opens / (workers * sum_sq) : 0;
+    printf("\nmode,workers,opens,opens_per_s,retries,p50_us,p99_us,p999_us,max_us,jain\n");
+    printf("%s,%d,%lu,%.0f,%lu,%.2f,%.2f,%.2f,%.2f,%.3f\n", mode_names[mode], workers, opens,
+           opens / elapsed, retries, lat_percentile(lat, opens, 0.5),
+           lat_percentile(lat, opens, 0.99), lat_percentile(lat, opens, 0.999), lat_max / 1e3,
+           jain);
+
+    munmap(results, map_size);
+    return ret ? EXIT_FAILURE : 0;
+}
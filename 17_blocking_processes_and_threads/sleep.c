@@ -1,16 +1,33 @@
 /*
  * sleep.c - create a /proc file, and if several processes try to open it
- * at the same time, they will block until the first one closes it.
+ * at the same time, they will block until the first one closes it. Readers
+ * are the exception: up to slots of them can have the file open together, only
+ * an opener that may write needs it to itself.
  */
 
 #include <linux/atmioc.h>
 #include <linux/fs.h>     // For file_operations structure
-#include <linux/kernel.h> // For sprintf()
+#include <linux/jiffies.h> // For msecs_to_jiffies
+#include <linux/kernel.h> // For min_t
+#include <linux/ktime.h>   // For ktime_get_ns
+#include <linux/list.h>    // For the queue of waiting openers
+#include <linux/log2.h>    // For the histogram buckets
+#include <linux/math64.h>  // For div64_u64
+#include <linux/moduleparam.h> // For module_param and module_param_cb
+#include <linux/mutex.h>   // For the per-file I/O lock
+#include <linux/percpu.h>  // For the per-CPU histograms
+#include <linux/poll.h>    // For poll_wait and EPOLL* masks
 #include <linux/proc_fs.h> // For proc_create and proc_remove
+#include <linux/sched.h>   // For schedule and wake_up_process
+#include <linux/sched/signal.h> // For signal_pending
+#include <linux/seq_file.h> // For seq_read and the statistics file
+#include <linux/slab.h>    // For kzalloc and kvzalloc
+#include <linux/spinlock.h> // For the opener queue lock
 #include <linux/types.h>
 #include <linux/uaccess.h> // For copy_to_user and copy_from_user
 #include <linux/version.h> // For kernel version checks
-#include <linux/wait.h>    // For wait queues
+#include <linux/wait.h>    // For the availability wait queue
+#include <linux/workqueue.h> // For the lease timers
 #include <linux/module.h>  // For module macros
 
 #include <asm/current.h>
@@ -25,35 +42,38 @@
  */
 
 #define MESSAGE_LENGTH 80
-static char message[MESSAGE_LENGTH];
+static unsigned int message_length = MESSAGE_LENGTH;
+module_param(message_length, uint, 0444);
+MODULE_PARM_DESC(message_length, "Bytes kept of the last input, including the null (default: 80)");
+
+/* Allocated at load time, message_length bytes. Only an opener that may write
+ * changes it, and such an opener has the file to itself.
+ */
+static char *message;
+static size_t message_used = 0;
 
 static struct proc_dir_entry *our_proc_file;
 #define PROC_ENTRY_FILENAME "sleep"
 
-/* Since we use the file operations struct, we can't use the special proc
- * output provisions - we have to use a standard read function, which is this
- * function.
- */
-static ssize_t module_output(struct file *filep, char __user *buffer, size_t length, loff_t *offset)
-{
-    static int finished = 0;
-    int i;
-    char output_msg[MESSAGE_LENGTH + 20];
+static struct proc_dir_entry *stats_proc_file;
+#define STATS_ENTRY_FILENAME "sleep_stats"
 
-    /* Return 0 to signify end of file - that we have nothing more to say
-     * at this point.
-     */
-    if (finished)
-    {
-        finished = 0;
-        return 0;
-    }
-    sprintf(output_msg, "Last input: %s\n", message);
-    for (i = 0; i < length && output_msg[i]; i++)
-        put_user(output_msg[i], buffer + i);
+static struct proc_dir_entry *hist_proc_file;
+#define HIST_ENTRY_FILENAME "sleep_hist"
+
+static struct proc_dir_entry *wait_proc_file;
+#define WAIT_ENTRY_FILENAME "sleep_wait"
 
-    finished = 1;
-    return i; // Return the number of bytes written
+/* Reads go through seq_file, which keeps the position and the output buffer
+ * per open file and copies it out in bulk, however many readers there are.
+ * This function produces the whole output of one read of the file.
+ */
+static int module_show(struct seq_file *m, void *v)
+{
+    seq_puts(m, "Last input: ");
+    seq_write(m, message, message_used);
+    seq_putc(m, '\n');
+    return 0;
 }
 
 /* This function receives input from the user when the user writes to the
@@ -62,33 +82,376 @@ static ssize_t module_output(struct file *filep, char __user *buffer, size_t len
 
 static ssize_t module_input(struct file *filep, const char __user *buffer, size_t length, loff_t *offset)
 {
-    int i;
-    /* Put the input into message, where module_output will later be able
+    size_t len = min_t(size_t, length, message_length - 1);
+
+    /* Put the input into message, where module_show will later be able
      * to use it.
      */
-    for (i = 0; i < MESSAGE_LENGTH - 1 && i < length; i++)
+    if (copy_from_user(message, buffer, len))
+        return -EFAULT; // Return error if copy fails
+    message[len] = '\0'; // Null-terminate the string
+    message_used = len;
+    return len;          // Return the number of bytes written
+}
+
+/* The file can be open by up to slots readers, or by a single writer.
+ * Opening with O_WRONLY or O_RDWR makes a writer.
+ */
+static unsigned int readers = 0;
+static bool writer = false;
+static unsigned int waiting_writers = 0;
+
+/* Every holder of the file owns one slot, taken from and given back to a
+ * stack of free ones, so admission is O(1) and each slot keeps its own
+ * accounting. slots, the number that may be held at once, can be changed
+ * at runtime in /sys/module/sleep/parameters/slots; lowering it lets the
+ * current holders keep theirs.
+ */
+#define MAX_SLOTS 64
+static unsigned int slots = MAX_SLOTS;
+static unsigned int free_slots[MAX_SLOTS];
+static unsigned int nr_free_slots = 0;
+
+/* Shown in /proc/sleep_stats, protected by openers_lock */
+static struct
+{
+    u64 opens;
+    u64 hold_ns_total;
+} slot_stats[MAX_SLOTS];
+
+/* A process sleeping in module_open() until the file is handed to it */
+struct opener
+{
+    struct list_head list;
+    struct task_struct *task;
+    bool write;
+    bool granted;      // set by module_close() when the file becomes ours
+    unsigned int slot; // valid once granted
+};
+
+/* Processes who want our file, in the order they asked for it. When the file
+ * is closed, module_close() admits the waiters that may enter and wakes up
+ * only those, instead of every sleeper waking up to race for it and all but
+ * one going back to sleep.
+ */
+static LIST_HEAD(openers);
+static DEFINE_SPINLOCK(openers_lock);
+
+/* Pollers of /proc/sleep_wait, woken when an open may succeed again */
+static DECLARE_WAIT_QUEUE_HEAD(avail_waitq);
+
+/* Shown in /proc/sleep_stats, protected by openers_lock */
+static struct
+{
+    u64 fast_opens;     // got the file without waiting
+    u64 handoffs;       // file passed from a closer to a waiter
+    u64 wakeups;        // sleepers woken by module_close()
+    u64 futile_wakeups; // sleepers that woke up and had to sleep again
+    u64 interrupted;    // waits ended by a signal
+    u64 revoked;        // holders whose lease ran out
+    u64 wait_ns_total;
+    u64 wait_ns_max;
+    unsigned int waiters;
+    unsigned int max_waiters;
+    unsigned int max_readers;
+} stats;
+
+/* Log2 histograms of how long openers wait in module_open(), how long they
+ * then keep the file, and how many waiters they find queued ahead of them.
+ * Bucket b counts values in [2^(b-1), 2^b), bucket 0 counts zeros. They are
+ * per CPU so recording one never bounces a shared cacheline; /proc/sleep_hist
+ * adds them up.
+ */
+#define HIST_BUCKETS 64
+
+struct sleep_hist
+{
+    u64 wait_ns[HIST_BUCKETS];
+    u64 hold_ns[HIST_BUCKETS];
+    u64 depth[HIST_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct sleep_hist, sleep_hist);
+
+static unsigned int hist_bucket(u64 v)
+{
+    return min_t(unsigned int, fls64(v), HIST_BUCKETS - 1);
+}
+
+#define hist_record(field, v) this_cpu_inc(sleep_hist.field[hist_bucket(v)])
+
+/* In lease mode a holder that does no I/O on the file for lease_ms loses
+ * it: its slot is given to the next waiter and its later reads and writes
+ * fail with -ETIMEDOUT, so a stopped or stuck holder cannot block the queue.
+ * The setting applies to files opened after it is changed.
+ */
+static unsigned int lease_ms = 0;
+module_param(lease_ms, uint, 0644);
+MODULE_PARM_DESC(lease_ms, "Idle time after which a holder loses the file, 0 to never (default: 0)");
+
+/* What we keep for each open file, as the private data of its seq_file */
+struct sleep_file
+{
+    u64 admitted_ns; // when module_open() let us in
+    unsigned int slot;
+    bool write;
+    unsigned long lease;         // in jiffies, 0 without a lease
+    struct delayed_work expire;  // runs when the lease runs out
+    struct mutex io_lock;        // held across I/O, so it never overlaps a revoke
+    bool revoked;                // under io_lock and openers_lock
+};
+
+/* Undo the allocations of module_open() */
+static void sleep_file_free(struct inode *inode, struct file *file)
+{
+    struct seq_file *m = file->private_data;
+
+    kfree(m->private);
+    single_release(inode, file);
+}
+
+/* Writers are preferred: once a writer waits, new readers queue behind it
+ * instead of keeping the file busy forever. Called with openers_lock held.
+ */
+static bool may_enter(bool write)
+{
+    if (write)
+        return !writer && !readers;
+    return !writer && !waiting_writers && readers < slots;
+}
+
+/* Returns the slot taken */
+static unsigned int enter(bool write)
+{
+    unsigned int slot = free_slots[--nr_free_slots];
+
+    if (write)
+    {
+        writer = true;
+    }
+    else
+    {
+        readers++;
+        stats.max_readers = max(stats.max_readers, readers);
+    }
+    slot_stats[slot].opens++;
+    return slot;
+}
+
+static void leave(bool write, unsigned int slot, u64 held)
+{
+    if (write)
+        writer = false;
+    else
+        readers--;
+    slot_stats[slot].hold_ns_total += held;
+    free_slots[nr_free_slots++] = slot;
+}
+
+static void grant(struct opener *next)
+{
+    list_del(&next->list);
+    stats.waiters--;
+    if (next->write)
+        waiting_writers--;
+    next->slot = enter(next->write);
+    stats.handoffs++;
+    stats.wakeups++;
+    /* next lives on the sleeper's stack, which stays valid until we drop
+     * openers_lock: the sleeper takes it before returning.
+     */
+    WRITE_ONCE(next->granted, true);
+    wake_up_process(next->task);
+}
+
+/* Hand the file to the waiters that may have it now and wake up only those:
+ * the first queued writer once the file is free, or, when no writer waits,
+ * queued readers in order while slots are free. Called with openers_lock
+ * held.
+ */
+static void admit_waiters(void)
+{
+    struct opener *next, *tmp;
+
+    if (waiting_writers)
     {
-        if (get_user(message[i], buffer + i))
-            return -EFAULT; // Return error if copy fails
+        if (!may_enter(true))
+            return;
+        list_for_each_entry(next, &openers, list)
+        {
+            if (next->write)
+            {
+                grant(next);
+                return;
+            }
+        }
+    }
+
+    list_for_each_entry_safe(next, tmp, &openers, list)
+    {
+        if (!may_enter(false))
+            break;
+        grant(next);
     }
-    message[i] = '\0'; // Null-terminate the string
-    return i;          // Return the number of bytes written
 }
 
-/* 1 if the file is currently open by somebody */
-static atomic_t already_open = ATOMIC_INIT(0);
+/* Whether a non-blocking open would get in now, see /proc/sleep_wait */
+static bool may_enter_now(void)
+{
+    return may_enter(false) || may_enter(true);
+}
 
-/* Queue of processes who want our file */
-static DECLARE_WAIT_QUEUE_HEAD(waitq);
+static int slots_set(const char *val, const struct kernel_param *kp)
+{
+    unsigned int n;
+    bool avail;
+    int ret;
+
+    ret = kstrtouint(val, 0, &n);
+    if (ret)
+        return ret;
+    if (n < 1 || n > MAX_SLOTS)
+        return -EINVAL;
+
+    /* More room may let waiters in */
+    spin_lock(&openers_lock);
+    slots = n;
+    admit_waiters();
+    avail = may_enter_now();
+    spin_unlock(&openers_lock);
+    if (avail)
+        wake_up_interruptible(&avail_waitq);
+    return 0;
+}
+
+static const struct kernel_param_ops slots_ops = {
+    .set = slots_set,
+    .get = param_get_uint,
+};
+
+module_param_cb(slots, &slots_ops, &slots, 0644);
+MODULE_PARM_DESC(slots, "Readers that may hold the file at once, 1 to 64 (default: 64)");
+
+/* The lease ran out: take the file away from its holder as if it had been
+ * closed. An I/O in progress finishes first.
+ */
+static void lease_expire(struct work_struct *work)
+{
+    struct sleep_file *sf = container_of(to_delayed_work(work), struct sleep_file, expire);
+    u64 held;
+    bool avail;
+
+    mutex_lock(&sf->io_lock);
+    /* An I/O we waited for renewed the lease */
+    if (sf->revoked || delayed_work_pending(&sf->expire))
+    {
+        mutex_unlock(&sf->io_lock);
+        return;
+    }
+    held = ktime_get_ns() - sf->admitted_ns;
+    spin_lock(&openers_lock);
+    sf->revoked = true;
+    stats.revoked++;
+    leave(sf->write, sf->slot, held);
+    admit_waiters();
+    avail = may_enter_now();
+    spin_unlock(&openers_lock);
+    mutex_unlock(&sf->io_lock);
+
+    hist_record(hold_ns, held);
+    if (avail)
+        wake_up_interruptible(&avail_waitq);
+}
+
+/* Called once the file is ours */
+static void lease_start(struct sleep_file *sf)
+{
+    sf->admitted_ns = ktime_get_ns();
+    if (sf->lease)
+        schedule_delayed_work(&sf->expire, sf->lease);
+}
+
+/* Returns with io_lock held if the file is still ours */
+static int lease_io_begin(struct sleep_file *sf)
+{
+    mutex_lock(&sf->io_lock);
+    if (sf->revoked)
+    {
+        mutex_unlock(&sf->io_lock);
+        return -ETIMEDOUT;
+    }
+    return 0;
+}
+
+static void lease_io_end(struct sleep_file *sf)
+{
+    if (sf->lease)
+        mod_delayed_work(system_wq, &sf->expire, sf->lease);
+    mutex_unlock(&sf->io_lock);
+}
+
+static ssize_t module_read(struct file *file, char __user *buffer, size_t length, loff_t *offset)
+{
+    struct sleep_file *sf = ((struct seq_file *)file->private_data)->private;
+    ssize_t ret;
+
+    ret = lease_io_begin(sf);
+    if (ret)
+        return ret;
+    ret = seq_read(file, buffer, length, offset);
+    lease_io_end(sf);
+    return ret;
+}
+
+static ssize_t module_write(struct file *file, const char __user *buffer, size_t length,
+                            loff_t *offset)
+{
+    struct sleep_file *sf = ((struct seq_file *)file->private_data)->private;
+    ssize_t ret;
+
+    ret = lease_io_begin(sf);
+    if (ret)
+        return ret;
+    ret = module_input(file, buffer, length, offset);
+    lease_io_end(sf);
+    return ret;
+}
 
 /* Called when the /proc file is opened */
 int module_open(struct inode *inode, struct file *file)
 {
+    struct opener me = {.task = current, .write = file->f_mode & FMODE_WRITE};
+    struct sleep_file *sf;
+    unsigned int ahead;
+    u64 start, waited;
+    int ret;
+
+    sf = kzalloc(sizeof(*sf), GFP_KERNEL);
+    if (!sf)
+        return -ENOMEM;
+    sf->write = me.write;
+    sf->lease = msecs_to_jiffies(READ_ONCE(lease_ms));
+    INIT_DELAYED_WORK(&sf->expire, lease_expire);
+    mutex_init(&sf->io_lock);
+    ret = single_open(file, module_show, sf);
+    if (ret)
+    {
+        kfree(sf);
+        return ret;
+    }
+
     /* Try to get without blocking */
-    if (!atomic_cmpxchg(&already_open, 0, 1))
+    spin_lock(&openers_lock);
+    if (may_enter(me.write))
     {
         /* Success without blocking, allow the access */
+        sf->slot = enter(me.write);
+        stats.fast_opens++;
+        spin_unlock(&openers_lock);
         try_module_get(THIS_MODULE);
+        hist_record(depth, 0);
+        hist_record(wait_ns, 0);
+        lease_start(sf);
         return 0;
     }
     /* If the file's flags include O_NONBLOCK, it means the process does not
@@ -97,67 +460,245 @@ int module_open(struct inode *inode, struct file *file)
      * instead of blocking a process which would rather stay awake.
      */
     if (file->f_flags & O_NONBLOCK)
+    {
+        spin_unlock(&openers_lock);
+        sleep_file_free(inode, file);
         return -EAGAIN; // File is already open, and we don't want to block
+    }
+
+    ahead = stats.waiters;
+    list_add_tail(&me.list, &openers);
+    if (me.write)
+        waiting_writers++;
+    stats.waiters++;
+    stats.max_waiters = max(stats.max_waiters, stats.waiters);
+    spin_unlock(&openers_lock);
 
     /* This is the correct place for try_module_get(THIS_MODULE) because if
      * a process is in the loop, which is within the kernel module,
      * the kernel module must not be removed.
      */
     try_module_get(THIS_MODULE);
-    while (atomic_cmpxchg(&already_open, 0, 1))
-    {
-        int i, is_sig = 0;
+    hist_record(depth, ahead);
 
-        /* This function puts the current process, including any system
-         * calls, such as us, to sleep. Execution will be resumed right
-         * after the function call, either because somebody called
-         * wake_up(&waitq) (only module_close does that, when the file
-         * is closed) or when a signal, such as Ctrl-C, is sent
-         * to the process
-         */
-        wait_event_interruptible(waitq, !atomic_read(&already_open));
-        /* If we woke up because we got a signal we're not blocking,
-         * return -EINTR (fail the system call). This allows processes
-         * to be killed or stopped.
+    start = ktime_get_ns();
+    for (;;)
+    {
+        /* This puts the current process, including any system calls, such
+         * as us, to sleep. Execution resumes when module_close() hands the
+         * file to us, or when a signal, such as Ctrl-C, is sent to the
+         * process.
          */
-        for (i = 0; i < _NSIG_WORDS && !is_sig; i++)
-            is_sig = current->pending.signal.sig[i] & current->blocked.sig[i];
-
-        if (is_sig)
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (READ_ONCE(me.granted) || signal_pending(current))
+            break;
+        schedule();
+        if (!READ_ONCE(me.granted) && !signal_pending(current))
         {
-            /* It is important to put module_put(THIS_MODULE) here, because
-             * for processes where the open is interrupted there will never
-             * be a corresponding close. If we do not decrement the usage
-             * count here, we will be left with a positive usage count
-             * which we will have no way to bring down to zero, giving us
-             * an immortal module, which can only be killed by rebooting
-             * the machine.
-             */
-            module_put(THIS_MODULE);
-            return -EINTR;
+            spin_lock(&openers_lock);
+            stats.futile_wakeups++;
+            spin_unlock(&openers_lock);
         }
     }
+    __set_current_state(TASK_RUNNING);
+
+    /* If a signal raced with module_close() handing us the file, we keep the
+     * file: module_close() already took us off the queue.
+     */
+    spin_lock(&openers_lock);
+    if (!me.granted)
+    {
+        bool avail;
+
+        /* Interrupted before our turn: leave the queue. A writer leaving
+         * may let the readers queued behind it in.
+         */
+        list_del(&me.list);
+        stats.waiters--;
+        stats.interrupted++;
+        if (me.write)
+            waiting_writers--;
+        admit_waiters();
+        avail = may_enter_now();
+        spin_unlock(&openers_lock);
+        if (avail)
+            wake_up_interruptible(&avail_waitq);
+
+        /* It is important to put module_put(THIS_MODULE) here, because
+         * for processes where the open is interrupted there will never
+         * be a corresponding close. If we do not decrement the usage
+         * count here, we will be left with a positive usage count
+         * which we will have no way to bring down to zero, giving us
+         * an immortal module, which can only be killed by rebooting
+         * the machine.
+         */
+        module_put(THIS_MODULE);
+        sleep_file_free(inode, file);
+        return -EINTR;
+    }
+    sf->slot = me.slot;
+    waited = ktime_get_ns() - start;
+    stats.wait_ns_total += waited;
+    stats.wait_ns_max = max(stats.wait_ns_max, waited);
+    spin_unlock(&openers_lock);
+    hist_record(wait_ns, waited);
+    lease_start(sf);
+
     return 0; /* Allow the access */
 }
 
 /* Called when the /proc file is closed */
 int module_close(struct inode *inode, struct file *file)
 {
-    /* Set already_open to zero, so one of the processes in the waitq will
-     * be able to set already_open back to one and to open the file. All
-     * the other processes will be called when already_open is back to one,
-     * so they'll go back to sleep.
-     */
-    atomic_set(&already_open, 0);
-    /* Wake up all the processes in waitq, so if anybody is waiting for the
-     * file, they can have it.
-     */
-    wake_up(&waitq);
+    struct sleep_file *sf = ((struct seq_file *)file->private_data)->private;
+    u64 held;
+    bool avail;
+
+    /* After this the lease can no longer run out under us */
+    cancel_delayed_work_sync(&sf->expire);
+    held = ktime_get_ns() - sf->admitted_ns;
+
+    spin_lock(&openers_lock);
+    /* A revoked holder already gave the file up */
+    if (!sf->revoked)
+        leave(sf->write, sf->slot, held);
+    admit_waiters();
+    avail = may_enter_now();
+    spin_unlock(&openers_lock);
+
+    if (!sf->revoked)
+        hist_record(hold_ns, held);
+    sleep_file_free(inode, file);
+
+    /* Waiters were served first, tell pollers only if there is room left */
+    if (avail)
+        wake_up_interruptible(&avail_waitq);
 
     module_put(THIS_MODULE);
     return 0; /* success */
 }
 
+/* /proc/sleep_stats: with direct handoff every wakeup hands over the file,
+ * so wakeups per handoff stays at 1 however many processes wait.
+ */
+static int stats_show(struct seq_file *m, void *v)
+{
+    u64 handoffs, wakeups, futile, wait_total;
+    unsigned int i;
+
+    spin_lock(&openers_lock);
+    seq_printf(m, "fast_opens: %llu\n", stats.fast_opens);
+    seq_printf(m, "handoffs: %llu\n", stats.handoffs);
+    seq_printf(m, "interrupted: %llu\n", stats.interrupted);
+    seq_printf(m, "revoked: %llu\n", stats.revoked);
+    seq_printf(m, "waiters: %u\n", stats.waiters);
+    seq_printf(m, "max_waiters: %u\n", stats.max_waiters);
+    seq_printf(m, "slots: %u\n", slots);
+    seq_printf(m, "readers: %u\n", readers);
+    seq_printf(m, "max_readers: %u\n", stats.max_readers);
+    seq_printf(m, "writer: %d\n", writer);
+    handoffs = stats.handoffs;
+    wakeups = stats.wakeups;
+    futile = stats.futile_wakeups;
+    wait_total = stats.wait_ns_total;
+    seq_printf(m, "wakeups: %llu\n", wakeups);
+    seq_printf(m, "futile_wakeups: %llu\n", futile);
+    seq_printf(m, "wait_ns_max: %llu\n", stats.wait_ns_max);
+    for (i = 0; i < MAX_SLOTS; i++)
+        if (slot_stats[i].opens)
+            seq_printf(m, "slot %u: opens %llu hold_ns %llu\n", i, slot_stats[i].opens,
+                       slot_stats[i].hold_ns_total);
+    spin_unlock(&openers_lock);
+
+    if (handoffs)
+    {
+        seq_printf(m, "wakeups_per_handoff_x100: %llu\n",
+                   div64_u64((wakeups + futile) * 100, handoffs));
+        seq_printf(m, "wait_ns_avg: %llu\n", div64_u64(wait_total, handoffs));
+    }
+    return 0;
+}
+
+static void hist_show_one(struct seq_file *m, const char *name, size_t offset)
+{
+    unsigned int b;
+    int cpu;
+
+    seq_printf(m, "%s:\n", name);
+    for (b = 0; b < HIST_BUCKETS; b++)
+    {
+        u64 count = 0;
+
+        for_each_possible_cpu(cpu)
+        {
+            const u64 *field = (void *)per_cpu_ptr(&sleep_hist, cpu) + offset;
+
+            count += field[b];
+        }
+        if (count)
+            seq_printf(m, "%20llu - %20llu: %llu\n", b ? 1ULL << (b - 1) : 0ULL,
+                       b ? (1ULL << b) - 1 : 0ULL, count);
+    }
+}
+
+/* /proc/sleep_hist: value ranges and how many samples fell into each */
+static int hist_show(struct seq_file *m, void *v)
+{
+    hist_show_one(m, "wait_ns", offsetof(struct sleep_hist, wait_ns));
+    hist_show_one(m, "hold_ns", offsetof(struct sleep_hist, hold_ns));
+    hist_show_one(m, "depth", offsetof(struct sleep_hist, depth));
+    return 0;
+}
+
+/* /proc/sleep_wait lets an event loop wait for /proc/sleep without a
+ * blocking open(): it polls readable when an O_RDONLY open would succeed and
+ * writable when an open for writing would. The open may still lose a race
+ * and get -EAGAIN, then poll again. Reading it shows the current state.
+ */
+static __poll_t wait_poll(struct file *file, poll_table *wait)
+{
+    __poll_t mask = 0;
+
+    poll_wait(file, &avail_waitq, wait);
+
+    spin_lock(&openers_lock);
+    if (may_enter(false))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (may_enter(true))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    spin_unlock(&openers_lock);
+
+    return mask;
+}
+
+static ssize_t wait_read(struct file *file, char __user *buffer, size_t length, loff_t *offset)
+{
+    char status[80];
+    int len;
+
+    spin_lock(&openers_lock);
+    len = scnprintf(status, sizeof(status), "slots: %u\nreaders: %u\nwriter: %d\nwaiters: %u\n",
+                    slots, readers, writer, stats.waiters);
+    spin_unlock(&openers_lock);
+
+    return simple_read_from_buffer(buffer, length, offset, status, len);
+}
+
+#ifdef HAVE_PROC_OPS
+static const struct proc_ops wait_proc_ops = {
+    .proc_read = wait_read,
+    .proc_poll = wait_poll,
+    .proc_lseek = noop_llseek,
+};
+#else
+static const struct file_operations wait_proc_ops = {
+    .owner = THIS_MODULE,
+    .read = wait_read,
+    .poll = wait_poll,
+    .llseek = noop_llseek,
+};
+#endif
+
 /* Structures to register as the /proc file, with pointers to all the relevant
  * functions.
  */
@@ -169,46 +710,96 @@ int module_close(struct inode *inode, struct file *file)
 
 #ifdef HAVE_PROC_OPS
 static const struct proc_ops file_ops_for_our_proc_file = {
-    .proc_read = module_output,
-    .proc_write = module_input,
+    .proc_read = module_read,
+    .proc_write = module_write,
     .proc_release = module_close,
     .proc_open = module_open,
-    .proc_lseek = noop_llseek,
+    .proc_lseek = seq_lseek,
 };
 #else
 static const struct file_operations file_ops_for_our_proc_file = {
     .owner = THIS_MODULE,
-    .read = module_output,
-    .write = module_input,
+    .read = module_read,
+    .write = module_write,
     .release = module_close,
     .open = module_open,
-    .llseek = noop_llseek,
+    .llseek = seq_lseek,
 };
 #endif
 
 static int __init sleep_init(void)
 {
+    unsigned int i;
+
+    /* Slot 0 on top, so a lightly used file keeps reusing the same few */
+    for (i = MAX_SLOTS; i > 0; i--)
+        free_slots[nr_free_slots++] = i - 1;
+
+    if (message_length < 2)
+        return -EINVAL;
+    message = kvzalloc(message_length, GFP_KERNEL);
+    if (message == NULL)
+        return -ENOMEM;
+
     our_proc_file = proc_create(PROC_ENTRY_FILENAME, 0644, NULL, &file_ops_for_our_proc_file);
     if (our_proc_file == NULL)
     {
+        kvfree(message);
         pr_debug("Error: Could not initialize /proc/%s\n",
                  PROC_ENTRY_FILENAME);
         return -ENOMEM;
     }
-    proc_set_size(our_proc_file, 80);
+    proc_set_size(our_proc_file, message_length);
     proc_set_user(our_proc_file, GLOBAL_ROOT_UID, GLOBAL_ROOT_GID);
+
+    stats_proc_file = proc_create_single(STATS_ENTRY_FILENAME, 0444, NULL, stats_show);
+    if (stats_proc_file == NULL)
+    {
+        remove_proc_entry(PROC_ENTRY_FILENAME, NULL);
+        kvfree(message);
+        pr_debug("Error: Could not initialize /proc/%s\n",
+                 STATS_ENTRY_FILENAME);
+        return -ENOMEM;
+    }
+
+    hist_proc_file = proc_create_single(HIST_ENTRY_FILENAME, 0444, NULL, hist_show);
+    if (hist_proc_file == NULL)
+    {
+        remove_proc_entry(STATS_ENTRY_FILENAME, NULL);
+        remove_proc_entry(PROC_ENTRY_FILENAME, NULL);
+        kvfree(message);
+        pr_debug("Error: Could not initialize /proc/%s\n",
+                 HIST_ENTRY_FILENAME);
+        return -ENOMEM;
+    }
+
+    wait_proc_file = proc_create(WAIT_ENTRY_FILENAME, 0444, NULL, &wait_proc_ops);
+    if (wait_proc_file == NULL)
+    {
+        remove_proc_entry(HIST_ENTRY_FILENAME, NULL);
+        remove_proc_entry(STATS_ENTRY_FILENAME, NULL);
+        remove_proc_entry(PROC_ENTRY_FILENAME, NULL);
+        kvfree(message);
+        pr_debug("Error: Could not initialize /proc/%s\n",
+                 WAIT_ENTRY_FILENAME);
+        return -ENOMEM;
+    }
     pr_info("/proc/%s created\n", PROC_ENTRY_FILENAME);
     return 0;
 }
 
 /* Cleanup - unregister our file from /proc. This could get dangerous if
- * there are still processes waiting in waitq, because they are inside our
+ * there are still processes waiting in openers, because they are inside our
  * open function, which will get unloaded. I'll explain how to avoid removal
  * of a kernel module in such a case in chapter 10.
  */
 static void __exit sleep_exit(void)
 {
+    remove_proc_entry(WAIT_ENTRY_FILENAME, NULL);
+    remove_proc_entry(HIST_ENTRY_FILENAME, NULL);
+    remove_proc_entry(STATS_ENTRY_FILENAME, NULL);
     remove_proc_entry(PROC_ENTRY_FILENAME, NULL);
+    kvfree(message);
     pr_debug("/proc/%s removed\n", PROC_ENTRY_FILENAME);
 }
 module_init(sleep_init);
@@ -0,0 +1,134 @@
+/*
+ * rpc_app.c - submit batches of work items to the rpc module and report how
+ * batching amortizes the system call, for batch sizes from 1 to the maximum.
+ *
+ * Every item of a run does the same op: nop measures the pure overhead, spin
+ * keeps a kernel worker busy for spin_ns. A first batch of sum items checks
+ * the results that come back.
+ *
+ * Build: gcc -O2 -o rpc_app rpc_app.c
+ * Usage: ./rpc_app [nop|spin] [seconds_per_size] [spin_ns]
+ */
+
+#include "../rpc.h"
+#include <stdio.h>     /* standard I/O */
+#include <fcntl.h>     /* open */
+#include <unistd.h>    /* close */
+#include <stdlib.h>    /* exit, strtoul */
+#include <string.h>    /* strcmp */
+#include <time.h>      /* clock_gettime */
+#include <sys/ioctl.h> /* ioctl */
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int submit(int fd, struct rpc_item *items, unsigned int count, struct rpc_batch *batch)
+{
+    batch->items = (__u64)(unsigned long)items;
+    batch->count = count;
+    batch->reserved = 0;
+    if (ioctl(fd, IOCTL_RPC_SUBMIT, batch) < 0)
+    {
+        perror("ioctl_rpc_submit failed");
+        return -1;
+    }
+    return 0;
+}
+
+/* Sum items with known answers must come back right: 0 + 1 + ... + (i - 1)
+ * is i * (i - 1) / 2
+ */
+static int check(int fd, struct rpc_item *items)
+{
+    struct rpc_batch batch;
+    unsigned int i;
+
+    for (i = 0; i < RPC_MAX_BATCH; i++)
+    {
+        items[i].op = RPC_OP_SUM;
+        items[i].arg = i;
+    }
+    if (submit(fd, items, RPC_MAX_BATCH, &batch) < 0)
+        return -1;
+    for (i = 0; i < RPC_MAX_BATCH; i++)
+    {
+        if (items[i].status || items[i].result != (__u64)i * (i - 1) / 2)
+        {
+            fprintf(stderr, "item %u: status %d result %llu\n", i, items[i].status,
+                    (unsigned long long)items[i].result);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *op_name = argc > 1 ? argv[1] : "nop";
+    double seconds = argc > 2 ? strtod(argv[2], NULL) : 1.0;
+    __u64 spin_ns = argc > 3 ? strtoul(argv[3], NULL, 0) : 1000;
+    static struct rpc_item items[RPC_MAX_BATCH];
+    unsigned int op, size, i;
+    int file_desc, ret = 0;
+
+    if (!strcmp(op_name, "nop"))
+        op = RPC_OP_NOP;
+    else if (!strcmp(op_name, "spin"))
+        op = RPC_OP_SPIN;
+    else
+    {
+        fprintf(stderr, "Usage: %s [nop|spin] [seconds_per_size] [spin_ns]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    file_desc = open(DEVICE_PATH, O_RDWR);
+    if (file_desc < 0)
+    {
+        perror("Can't open device file");
+        exit(EXIT_FAILURE);
+    }
+
+    if (check(file_desc, items) < 0)
+    {
+        close(file_desc);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("op,batch,batches,items_per_s,us_per_batch,kernel_us_per_batch\n");
+    for (size = 1; size <= RPC_MAX_BATCH && !ret; size *= 4)
+    {
+        struct rpc_batch batch;
+        unsigned long batches = 0;
+        double start, elapsed, kernel_ns = 0;
+
+        start = now_sec();
+        do
+        {
+            for (i = 0; i < size; i++)
+            {
+                items[i].op = op;
+                items[i].arg = spin_ns;
+            }
+            if (submit(file_desc, items, size, &batch) < 0)
+            {
+                ret = -1;
+                break;
+            }
+            kernel_ns += batch.elapsed_ns;
+            batches++;
+        } while (now_sec() - start < seconds);
+        elapsed = now_sec() - start;
+
+        if (batches)
+            printf("%s,%u,%lu,%.0f,%.2f,%.2f\n", op_name, size, batches,
+                   batches * size / elapsed, elapsed * 1e6 / batches, kernel_ns / 1e3 / batches);
+    }
+
+    close(file_desc);
+    return ret ? EXIT_FAILURE : 0;
+}
@@ -1,5 +1,12 @@
 /*
  * completion.c - Example of using completion in kernel module
+ *
+ * With stream_items set, the crank also streams that many items to the
+ * flywheel through a single-producer/single-consumer ring before the two
+ * complete as usual. Neither side takes a lock: the crank publishes its head
+ * every batch items, and each side sleeps only when the ring is empty (or
+ * full) and is woken only if it does. Items per second and wakeups per item
+ * are printed when the flywheel is done, to tune batch against.
  */
 
 #include <linux/module.h>
@@ -8,15 +15,118 @@
 #include <linux/init.h>
 #include <linux/err.h> /* for IS_ERR() */
 #include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/log2.h> /* for is_power_of_2() */
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
 #include <linux/printk.h>
+#include <linux/slab.h>
 #include <linux/version.h>
+#include <linux/wait.h>
+
+static unsigned long stream_items = 0;
+module_param(stream_items, ulong, 0444);
+MODULE_PARM_DESC(stream_items, "Items the crank streams to the flywheel, 0 for none (default: 0)");
+
+static unsigned int ring_size = 1024;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Ring slots, a power of 2 (default: 1024)");
+
+static unsigned int batch = 1;
+module_param(batch, uint, 0444);
+MODULE_PARM_DESC(batch, "Items the crank writes before publishing them (default: 1)");
 
 static struct completion crank_completion;
 static struct completion flywheel_completion;
 
+/* The ring: each index is written by one side only and lives on its own
+ * cacheline, so the sides don't bounce each other's.
+ */
+static struct
+{
+    u64 *slots;
+    unsigned long head ____cacheline_aligned_in_smp; /* written by the crank */
+    unsigned long tail ____cacheline_aligned_in_smp; /* written by the flywheel */
+    wait_queue_head_t data_wq;                       /* flywheel waits for items */
+    wait_queue_head_t space_wq;                      /* crank waits for room */
+    unsigned long wakeups;                           /* of the flywheel */
+    unsigned long crank_sleeps;
+    unsigned long flywheel_sleeps;
+    u64 start_ns;
+} ring;
+
+/* Make the items before head visible, waking the flywheel if it sleeps */
+static void crank_publish(unsigned long head)
+{
+    smp_store_release(&ring.head, head);
+    /* Has the barrier that pairs with the one in wait_event() */
+    if (wq_has_sleeper(&ring.data_wq))
+    {
+        ring.wakeups++;
+        wake_up(&ring.data_wq);
+    }
+}
+
+static void crank_produce(void)
+{
+    unsigned long head = 0, published = 0, mask = ring_size - 1;
+    u64 i;
+
+    for (i = 0; i < stream_items; i++)
+    {
+        if (head - smp_load_acquire(&ring.tail) == ring_size)
+        {
+            crank_publish(head);
+            published = head;
+            ring.crank_sleeps++;
+            wait_event(ring.space_wq, head - smp_load_acquire(&ring.tail) < ring_size);
+        }
+        ring.slots[head & mask] = i;
+        head++;
+        if (head - published >= batch)
+        {
+            crank_publish(head);
+            published = head;
+        }
+    }
+    crank_publish(head);
+}
+
+static void flywheel_consume(void)
+{
+    unsigned long tail = 0, mask = ring_size - 1, bad = 0;
+    u64 elapsed;
+
+    while (tail < stream_items)
+    {
+        unsigned long head = smp_load_acquire(&ring.head);
+
+        if (head == tail)
+        {
+            ring.flywheel_sleeps++;
+            wait_event(ring.data_wq, smp_load_acquire(&ring.head) != tail);
+            continue;
+        }
+        for (; tail != head; tail++)
+            bad += ring.slots[tail & mask] != tail;
+        smp_store_release(&ring.tail, tail);
+        if (wq_has_sleeper(&ring.space_wq))
+            wake_up(&ring.space_wq);
+    }
+
+    elapsed = max(ktime_get_ns() - ring.start_ns, 1ULL);
+    pr_info("Streamed %lu items in %llu ns: %llu items/s, %llu wakeups per 1000 items\n",
+            stream_items, elapsed, div64_u64((u64)stream_items * NSEC_PER_SEC, elapsed),
+            div64_u64((u64)ring.wakeups * 1000, stream_items));
+    pr_info("Crank slept %lu times, flywheel %lu times, %lu items out of order\n",
+            ring.crank_sleeps, ring.flywheel_sleeps, bad);
+}
+
 static int machine_crank_thread(void *arg)
 {
     pr_info("Turn the crank\n");
+    if (stream_items)
+        crank_produce();
 
     complete_all(&crank_completion);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
@@ -29,6 +139,8 @@ static int machine_crank_thread(void *arg)
 static int machine_flywheel_spinup_thread(void *arg)
 {
     pr_info("Turn the flywheel\n");
+    if (stream_items)
+        flywheel_consume();
     // wait for the crank to complete before spinning up the flywheel
     wait_for_completion(&crank_completion);
 
@@ -52,6 +164,17 @@ static int __init completions_init(void)
     init_completion(&crank_completion);
     init_completion(&flywheel_completion);
 
+    if (stream_items)
+    {
+        if (!is_power_of_2(ring_size) || batch == 0 || batch > ring_size)
+            return -EINVAL;
+        ring.slots = kmalloc_array(ring_size, sizeof(*ring.slots), GFP_KERNEL);
+        if (!ring.slots)
+            return -ENOMEM;
+        init_waitqueue_head(&ring.data_wq);
+        init_waitqueue_head(&ring.space_wq);
+    }
+
     // create two kernel threads
     crank_thread = kthread_create(machine_crank_thread, NULL, "Kthread Crank");
     if (IS_ERR(crank_thread))
@@ -62,6 +185,7 @@ static int __init completions_init(void)
     
     // wake up the threads
     pr_info("Waking up crank thread and flywheel thread");
+    ring.start_ns = ktime_get_ns();
     wake_up_process(flywheel_thread);
     wake_up_process(crank_thread);
 
@@ -70,6 +194,7 @@ static int __init completions_init(void)
 ERROR_THREAD_2:
     kthread_stop(crank_thread);
 ERROR_THREAD_1:
+    kfree(ring.slots);
     return -1;
 }
 
@@ -77,6 +202,7 @@ static void __exit completions_exit(void)
 {
     wait_for_completion(&crank_completion);
     wait_for_completion(&flywheel_completion);
+    kfree(ring.slots);
 
     pr_info("completions exit\n");
 }
@@ -0,0 +1,95 @@
+/*
+ * completion_group.h - wait for many kthreads at once
+ *
+ * A completion group is a completion that fires when all of its members have
+ * called completion_group_done(), so waiting for N workers costs one sleep
+ * instead of N calls to wait_for_completion() and up to N wakeups.
+ *
+ * A kbarrier lets a fixed set of threads work in phases: each kbarrier_wait()
+ * returns once all parties have reached it, and the barrier can be used
+ * again right away for the next phase.
+ */
+
+#ifndef COMPLETION_GROUP_H
+#define COMPLETION_GROUP_H
+
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/wait.h>
+
+struct completion_group
+{
+    atomic_t pending;
+    struct completion done;
+};
+
+static inline void completion_group_init(struct completion_group *g, unsigned int members)
+{
+    atomic_set(&g->pending, members);
+    init_completion(&g->done);
+}
+
+/* Only once every member is done and all waiters have returned */
+static inline void completion_group_reinit(struct completion_group *g, unsigned int members)
+{
+    atomic_set(&g->pending, members);
+    reinit_completion(&g->done);
+}
+
+/* Called by each member when it is done; the last one wakes the waiters */
+static inline void completion_group_done(struct completion_group *g)
+{
+    if (atomic_dec_and_test(&g->pending))
+        complete_all(&g->done);
+}
+
+static inline void completion_group_wait(struct completion_group *g)
+{
+    wait_for_completion(&g->done);
+}
+
+static inline int completion_group_wait_interruptible(struct completion_group *g)
+{
+    return wait_for_completion_interruptible(&g->done);
+}
+
+struct kbarrier
+{
+    unsigned int parties;
+    atomic_t arrived;
+    unsigned int generation; /* phases completed */
+    wait_queue_head_t wq;
+};
+
+static inline void kbarrier_init(struct kbarrier *b, unsigned int parties)
+{
+    b->parties = parties;
+    atomic_set(&b->arrived, 0);
+    b->generation = 0;
+    init_waitqueue_head(&b->wq);
+}
+
+/* Returns true in exactly one of the parties of each phase, the last to
+ * arrive. The others have been released by then, so it is only good for
+ * bookkeeping such as counting phases.
+ */
+static inline bool kbarrier_wait(struct kbarrier *b)
+{
+    unsigned int gen = smp_load_acquire(&b->generation);
+
+    /* atomic_inc_return() is a full barrier: gen was read before we arrive */
+    if (atomic_inc_return(&b->arrived) == b->parties)
+    {
+        /* Nobody arrives for the next phase until they see the new
+         * generation, so arrived can be reset first.
+         */
+        atomic_set(&b->arrived, 0);
+        smp_store_release(&b->generation, gen + 1);
+        wake_up_all(&b->wq);
+        return true;
+    }
+    wait_event(b->wq, smp_load_acquire(&b->generation) != gen);
+    return false;
+}
+
+#endif
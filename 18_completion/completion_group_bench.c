@@ -0,0 +1,200 @@
+/*
+ * completion_group_bench.c - wait for N kthreads with N completions, with
+ * one completion group, and with a barrier, and compare the cost.
+ *
+ * The workers live for the whole run and start each round together from a
+ * kbarrier. In each round they spin for work_ns and then signal, either:
+ *   each    - complete() their own completion, waited for one by one as
+ *             completions_exit() in completion.c does
+ *   group   - completion_group_done() on a shared group, waited for once
+ *   barrier - kbarrier_wait() on a second barrier that the main thread
+ *             also waits on
+ * The time per round is measured from the start barrier until the main
+ * thread knows all workers are done.
+ *
+ * Runs once at load time and prints to the kernel log.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/completion.h>
+#include <linux/err.h> /* for IS_ERR() */
+#include <linux/init.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mm.h> /* for kvcalloc() */
+#include <linux/moduleparam.h>
+#include <linux/sched.h>
+
+#include "completion_group.h"
+
+static unsigned int workers = 256;
+module_param(workers, uint, 0444);
+MODULE_PARM_DESC(workers, "Worker kthreads (default: 256)");
+
+static unsigned int rounds = 1000;
+module_param(rounds, uint, 0444);
+MODULE_PARM_DESC(rounds, "Rounds per way of waiting (default: 1000)");
+
+static unsigned int work_ns = 0;
+module_param(work_ns, uint, 0444);
+MODULE_PARM_DESC(work_ns, "How long each worker spins per round (default: 0)");
+
+enum mode
+{
+    MODE_EACH,
+    MODE_GROUP,
+    MODE_BARRIER,
+    MODE_COUNT,
+};
+
+static const char *const mode_names[MODE_COUNT] = {"each", "group", "barrier"};
+
+static enum mode mode;
+static struct kbarrier start_barrier;
+static struct kbarrier end_barrier;
+static struct completion *each_done;
+static struct completion_group group_done;
+static struct task_struct **threads;
+
+static int worker_thread(void *arg)
+{
+    unsigned long id = (unsigned long)arg;
+    unsigned int m, r;
+
+    for (m = 0; m < MODE_COUNT; m++)
+    {
+        for (r = 0; r < rounds; r++)
+        {
+            u64 end;
+
+            kbarrier_wait(&start_barrier);
+            end = ktime_get_ns() + work_ns;
+            while (ktime_get_ns() < end)
+                cpu_relax();
+
+            switch (READ_ONCE(mode))
+            {
+            case MODE_EACH:
+                complete(&each_done[id]);
+                break;
+            case MODE_GROUP:
+                completion_group_done(&group_done);
+                break;
+            default:
+                kbarrier_wait(&end_barrier);
+                break;
+            }
+        }
+    }
+
+    /* Stay around for kthread_stop(), so no worker runs our code after
+     * the module is gone.
+     */
+    set_current_state(TASK_INTERRUPTIBLE);
+    while (!kthread_should_stop())
+    {
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
+    }
+    __set_current_state(TASK_RUNNING);
+    return 0;
+}
+
+static void run_mode(enum mode m)
+{
+    u64 total = 0;
+    unsigned int i, r;
+
+    WRITE_ONCE(mode, m);
+    for (r = 0; r < rounds; r++)
+    {
+        u64 start;
+
+        /* Every worker is done with the last round, so rearming is safe */
+        if (m == MODE_EACH)
+            for (i = 0; i < workers; i++)
+                reinit_completion(&each_done[i]);
+        else if (m == MODE_GROUP)
+            completion_group_reinit(&group_done, workers);
+
+        start = ktime_get_ns();
+        kbarrier_wait(&start_barrier);
+        if (m == MODE_EACH)
+            for (i = 0; i < workers; i++)
+                wait_for_completion(&each_done[i]);
+        else if (m == MODE_GROUP)
+            completion_group_wait(&group_done);
+        else
+            kbarrier_wait(&end_barrier);
+        total += ktime_get_ns() - start;
+    }
+
+    pr_info("%s,%u,%u,%llu,%llu\n", mode_names[m], workers, work_ns, div64_u64(total, rounds),
+            div64_u64(total, (u64)rounds * workers));
+}
+
+static int __init completion_group_bench_init(void)
+{
+    unsigned long i;
+    int ret = 0;
+    enum mode m;
+
+    if (workers == 0 || rounds == 0)
+        return -EINVAL;
+    each_done = kvcalloc(workers, sizeof(*each_done), GFP_KERNEL);
+    threads = kvcalloc(workers, sizeof(*threads), GFP_KERNEL);
+    if (!each_done || !threads)
+    {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+
+    for (i = 0; i < workers; i++)
+        init_completion(&each_done[i]);
+    completion_group_init(&group_done, workers);
+    /* The workers and us */
+    kbarrier_init(&start_barrier, workers + 1);
+    kbarrier_init(&end_barrier, workers + 1);
+
+    /* Create them all before starting any, so that if one can't be
+     * created the others can still be stopped without running.
+     */
+    for (i = 0; i < workers; i++)
+    {
+        threads[i] = kthread_create(worker_thread, (void *)i, "compgrp_bench/%lu", i);
+        if (IS_ERR(threads[i]))
+        {
+            ret = PTR_ERR(threads[i]);
+            threads[i] = NULL;
+            goto out_stop;
+        }
+    }
+    for (i = 0; i < workers; i++)
+        wake_up_process(threads[i]);
+
+    pr_info("mode,workers,work_ns,ns_per_round,ns_per_worker\n");
+    for (m = 0; m < MODE_COUNT; m++)
+        run_mode(m);
+
+out_stop:
+    for (i = 0; i < workers && threads[i]; i++)
+        kthread_stop(threads[i]);
+out_free:
+    kvfree(threads);
+    kvfree(each_done);
+    return ret;
+}
+
+static void __exit completion_group_bench_exit(void)
+{
+    pr_info("completion_group_bench exit\n");
+}
+module_init(completion_group_bench_init);
+module_exit(completion_group_bench_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("HOUSSEM JARRAY");
+MODULE_DESCRIPTION("Benchmark of completion groups and barriers against one completion per worker");
+MODULE_VERSION("1.0");
@@ -0,0 +1,291 @@
+/*
+ * handoff_bench.c - how long it takes one kthread to wake another, for each
+ * way of waiting for an event the kernel offers.
+ *
+ * Two kthreads pinned to chosen CPUs pass a turn back and forth; the round
+ * trip time is measured for each of:
+ *   completion - complete() and wait_for_completion(), as in completion.c
+ *   waitqueue  - wake_up() and wait_event()
+ *   swait      - swake_up_one() and swait_event_exclusive(), the simple
+ *                wait queue that completions are built on
+ *   spin       - poll the turn for up to spin_ns, then wait_event(); the
+ *                passer only calls wake_up() if the other side sleeps. This
+ *                is the kernel side equivalent of a futex with spinning.
+ * and for each placement of the two threads:
+ *   same_core    - SMT siblings, or the same CPU without SMT
+ *   same_llc     - different cores in one package
+ *   cross_socket - different packages
+ * Placements the machine doesn't have are skipped. Cores in a package are
+ * taken to share the last level cache, which holds on most but not all
+ * CPUs.
+ *
+ * Runs once at load time and prints the round trip percentiles to the
+ * kernel log.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/err.h> /* for IS_ERR() */
+#include <linux/init.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/mm.h> /* for kvcalloc() */
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/swait.h>
+#include <linux/topology.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+
+static unsigned int rounds = 100000;
+module_param(rounds, uint, 0444);
+MODULE_PARM_DESC(rounds, "Round trips per primitive and placement (default: 100000)");
+
+static unsigned int spin_ns = 5000;
+module_param(spin_ns, uint, 0444);
+MODULE_PARM_DESC(spin_ns, "How long the spin primitive polls before sleeping (default: 5000)");
+
+enum handoff
+{
+    HANDOFF_COMPLETION,
+    HANDOFF_WAITQUEUE,
+    HANDOFF_SWAIT,
+    HANDOFF_SPIN,
+    HANDOFF_COUNT,
+};
+
+static const char *const handoff_names[HANDOFF_COUNT] = {
+    "completion", "waitqueue", "swait", "spin",
+};
+
+/* What each of the two threads waits on */
+struct side
+{
+    struct completion go;
+    wait_queue_head_t wq;
+    struct swait_queue_head swq;
+    struct completion finished;
+};
+
+struct pingpong
+{
+    enum handoff how;
+    bool may_spin; /* the threads are on different CPUs */
+    int turn;      /* the side that may run, for all but completion */
+    struct side side[2];
+    u64 *rtt;
+};
+
+static void pp_pass(struct pingpong *pp, int to)
+{
+    struct side *s = &pp->side[to];
+
+    switch (pp->how)
+    {
+    case HANDOFF_COMPLETION:
+        complete(&s->go);
+        break;
+    case HANDOFF_WAITQUEUE:
+        smp_store_release(&pp->turn, to);
+        wake_up(&s->wq);
+        break;
+    case HANDOFF_SWAIT:
+        smp_store_release(&pp->turn, to);
+        swake_up_one(&s->swq);
+        break;
+    default:
+        smp_store_release(&pp->turn, to);
+        /* Has the barrier that pairs with the one in wait_event() */
+        if (wq_has_sleeper(&s->wq))
+            wake_up(&s->wq);
+        break;
+    }
+}
+
+static void pp_wait(struct pingpong *pp, int me)
+{
+    struct side *s = &pp->side[me];
+
+    switch (pp->how)
+    {
+    case HANDOFF_COMPLETION:
+        wait_for_completion(&s->go);
+        break;
+    case HANDOFF_WAITQUEUE:
+        wait_event(s->wq, smp_load_acquire(&pp->turn) == me);
+        break;
+    case HANDOFF_SWAIT:
+        swait_event_exclusive(s->swq, smp_load_acquire(&pp->turn) == me);
+        break;
+    default:
+        if (pp->may_spin)
+        {
+            u64 deadline = ktime_get_ns() + spin_ns;
+
+            while (smp_load_acquire(&pp->turn) != me && ktime_get_ns() < deadline)
+                cpu_relax();
+        }
+        wait_event(s->wq, smp_load_acquire(&pp->turn) == me);
+        break;
+    }
+}
+
+static int pinger_thread(void *arg)
+{
+    struct pingpong *pp = arg;
+    unsigned int i;
+
+    for (i = 0; i < rounds; i++)
+    {
+        u64 start = ktime_get_ns();
+
+        pp_pass(pp, 1);
+        pp_wait(pp, 0);
+        pp->rtt[i] = ktime_get_ns() - start;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+    kthread_complete_and_exit(&pp->side[0].finished, 0);
+#else
+    complete_and_exit(&pp->side[0].finished, 0);
+#endif
+}
+
+static int echo_thread(void *arg)
+{
+    struct pingpong *pp = arg;
+    unsigned int i;
+
+    for (i = 0; i < rounds; i++)
+    {
+        pp_wait(pp, 1);
+        pp_pass(pp, 0);
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+    kthread_complete_and_exit(&pp->side[1].finished, 0);
+#else
+    complete_and_exit(&pp->side[1].finished, 0);
+#endif
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int run_one(struct pingpong *pp, const char *placement, int cpu_a, int cpu_b)
+{
+    struct task_struct *pinger, *echo;
+    int i;
+
+    pp->may_spin = cpu_a != cpu_b;
+    pp->turn = 0;
+    for (i = 0; i < 2; i++)
+    {
+        init_completion(&pp->side[i].go);
+        init_waitqueue_head(&pp->side[i].wq);
+        init_swait_queue_head(&pp->side[i].swq);
+        init_completion(&pp->side[i].finished);
+    }
+
+    pinger = kthread_create(pinger_thread, pp, "handoff/%d", cpu_a);
+    if (IS_ERR(pinger))
+        return PTR_ERR(pinger);
+    echo = kthread_create(echo_thread, pp, "handoff/%d", cpu_b);
+    if (IS_ERR(echo))
+    {
+        kthread_stop(pinger);
+        return PTR_ERR(echo);
+    }
+    kthread_bind(pinger, cpu_a);
+    kthread_bind(echo, cpu_b);
+
+    wake_up_process(echo);
+    wake_up_process(pinger);
+    wait_for_completion(&pp->side[0].finished);
+    wait_for_completion(&pp->side[1].finished);
+
+    sort(pp->rtt, rounds, sizeof(*pp->rtt), cmp_u64, NULL);
+    pr_info("%s,%s,%d,%d,%llu,%llu,%llu,%llu\n", handoff_names[pp->how], placement, cpu_a, cpu_b,
+            pp->rtt[rounds / 2], pp->rtt[(u64)rounds * 99 / 100],
+            pp->rtt[(u64)rounds * 999 / 1000], pp->rtt[rounds - 1]);
+    return 0;
+}
+
+/* An online CPU other than cpu in mask, or outside it if !inside */
+static int pick_cpu(int cpu, const struct cpumask *mask, bool inside)
+{
+    int other;
+
+    for_each_online_cpu(other)
+        if (other != cpu && cpumask_test_cpu(other, mask) == inside)
+            return other;
+    return -1;
+}
+
+static int __init handoff_bench_init(void)
+{
+    struct pingpong *pp;
+    int cpu = cpumask_first(cpu_online_mask);
+    int placement_cpu[3];
+    static const char *const placement_names[3] = {"same_core", "same_llc", "cross_socket"};
+    int p, ret = 0;
+
+    if (rounds == 0)
+        return -EINVAL;
+    pp = kzalloc(sizeof(*pp), GFP_KERNEL);
+    if (!pp)
+        return -ENOMEM;
+    pp->rtt = kvcalloc(rounds, sizeof(*pp->rtt), GFP_KERNEL);
+    if (!pp->rtt)
+    {
+        kfree(pp);
+        return -ENOMEM;
+    }
+
+    placement_cpu[0] = pick_cpu(cpu, topology_sibling_cpumask(cpu), true);
+    if (placement_cpu[0] < 0)
+        placement_cpu[0] = cpu;
+    placement_cpu[1] = -1;
+    for_each_online_cpu(p)
+    {
+        if (cpumask_test_cpu(p, topology_core_cpumask(cpu)) &&
+            !cpumask_test_cpu(p, topology_sibling_cpumask(cpu)))
+        {
+            placement_cpu[1] = p;
+            break;
+        }
+    }
+    placement_cpu[2] = pick_cpu(cpu, topology_core_cpumask(cpu), false);
+
+    pr_info("primitive,placement,cpu_a,cpu_b,rtt_ns_p50,rtt_ns_p99,rtt_ns_p999,rtt_ns_max\n");
+    for (pp->how = 0; pp->how < HANDOFF_COUNT && !ret; pp->how++)
+    {
+        for (p = 0; p < 3 && !ret; p++)
+        {
+            if (placement_cpu[p] < 0)
+                continue;
+            ret = run_one(pp, placement_names[p], cpu, placement_cpu[p]);
+        }
+    }
+
+    kvfree(pp->rtt);
+    kfree(pp);
+    return ret;
+}
+
+static void __exit handoff_bench_exit(void)
+{
+    pr_info("handoff_bench exit\n");
+}
+module_init(handoff_bench_init);
+module_exit(handoff_bench_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("HOUSSEM JARRAY");
+MODULE_DESCRIPTION("Round trip latency of kthread handoff primitives");
+MODULE_VERSION("1.0");
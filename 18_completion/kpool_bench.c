@@ -0,0 +1,187 @@
+/*
+ * kpool_bench.c - compare handing short tasks to kthread_pool.ko with
+ * creating a kthread for each task, as completion.c does.
+ *
+ * Runs once at load time and prints to the kernel log:
+ *   pool_burst  - tasks queued back to back, then waited for together
+ *   pool_single - one task at a time, queued and waited for
+ *   kthread     - one task at a time, each in a new kthread
+ * For each, the dispatch latency from queueing (or kthread_run()) until the
+ * task starts, and the tasks per second.
+ *
+ * Usage: insmod kthread_pool.ko && insmod kpool_bench.ko; dmesg
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/err.h> /* for IS_ERR() */
+#include <linux/init.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mm.h> /* for kvcalloc() */
+#include <linux/moduleparam.h>
+#include <linux/sort.h>
+#include <linux/version.h>
+
+#include "kthread_pool.h"
+
+static unsigned int tasks = 100000;
+module_param(tasks, uint, 0444);
+MODULE_PARM_DESC(tasks, "Tasks for the pool runs (default: 100000)");
+
+static unsigned int thread_tasks = 2000;
+module_param(thread_tasks, uint, 0444);
+MODULE_PARM_DESC(thread_tasks, "Tasks for the kthread per task run (default: 2000)");
+
+struct bench_task
+{
+    struct kpool_work work;
+    u64 queued_ns;
+    u64 latency_ns;
+};
+
+static struct bench_task *bench_tasks;
+static atomic_t left;
+static struct completion done;
+
+static void bench_func(struct kpool_work *work)
+{
+    struct bench_task *t = container_of(work, struct bench_task, work);
+
+    t->latency_ns = ktime_get_ns() - t->queued_ns;
+    if (atomic_dec_and_test(&left))
+        complete(&done);
+}
+
+/* Exits through the core kernel, so once done completes no thread runs our
+ * code any more and a failing init can return right away
+ */
+static int bench_thread(void *arg)
+{
+    struct bench_task *t = arg;
+
+    t->latency_ns = ktime_get_ns() - t->queued_ns;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+    kthread_complete_and_exit(&done, 0);
+#else
+    complete_and_exit(&done, 0);
+#endif
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Prints the latency percentiles of the first n tasks */
+static void bench_report(const char *name, unsigned int n, u64 elapsed_ns)
+{
+    u64 *lat;
+    unsigned int i;
+
+    if (n == 0)
+        return;
+    lat = kvcalloc(n, sizeof(*lat), GFP_KERNEL);
+    if (!lat)
+        return;
+    for (i = 0; i < n; i++)
+        lat[i] = bench_tasks[i].latency_ns;
+    sort(lat, n, sizeof(*lat), cmp_u64, NULL);
+
+    pr_info("%s: %u tasks, %llu tasks/s, dispatch ns p50 %llu p99 %llu max %llu\n", name, n,
+            div64_u64((u64)n * NSEC_PER_SEC, max(elapsed_ns, 1ULL)), lat[n / 2],
+            lat[(u64)n * 99 / 100], lat[n - 1]);
+    kvfree(lat);
+}
+
+static void bench_pool_burst(void)
+{
+    unsigned int i;
+    u64 start;
+
+    init_completion(&done);
+    atomic_set(&left, tasks);
+    start = ktime_get_ns();
+    for (i = 0; i < tasks; i++)
+    {
+        kpool_init_work(&bench_tasks[i].work, bench_func);
+        bench_tasks[i].queued_ns = ktime_get_ns();
+        kpool_queue(&bench_tasks[i].work);
+    }
+    wait_for_completion(&done);
+    bench_report("pool_burst", tasks, ktime_get_ns() - start);
+}
+
+static void bench_pool_single(void)
+{
+    unsigned int i;
+    u64 start;
+
+    start = ktime_get_ns();
+    for (i = 0; i < tasks; i++)
+    {
+        init_completion(&done);
+        atomic_set(&left, 1);
+        kpool_init_work(&bench_tasks[i].work, bench_func);
+        bench_tasks[i].queued_ns = ktime_get_ns();
+        kpool_queue(&bench_tasks[i].work);
+        wait_for_completion(&done);
+    }
+    bench_report("pool_single", tasks, ktime_get_ns() - start);
+}
+
+static int bench_kthread(void)
+{
+    unsigned int i;
+    u64 start;
+
+    start = ktime_get_ns();
+    for (i = 0; i < thread_tasks; i++)
+    {
+        struct task_struct *thread;
+
+        init_completion(&done);
+        bench_tasks[i].queued_ns = ktime_get_ns();
+        thread = kthread_run(bench_thread, &bench_tasks[i], "kpool_bench");
+        if (IS_ERR(thread))
+            return PTR_ERR(thread);
+        wait_for_completion(&done);
+    }
+    bench_report("kthread", thread_tasks, ktime_get_ns() - start);
+    return 0;
+}
+
+static int __init kpool_bench_init(void)
+{
+    int ret;
+
+    if (tasks == 0 || thread_tasks > tasks)
+        return -EINVAL;
+    bench_tasks = kvcalloc(tasks, sizeof(*bench_tasks), GFP_KERNEL);
+    if (!bench_tasks)
+        return -ENOMEM;
+
+    bench_pool_burst();
+    bench_pool_single();
+    ret = bench_kthread();
+
+    kvfree(bench_tasks);
+    return ret;
+}
+
+static void __exit kpool_bench_exit(void)
+{
+    pr_info("kpool_bench exit\n");
+}
+module_init(kpool_bench_init);
+module_exit(kpool_bench_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("HOUSSEM JARRAY");
+MODULE_DESCRIPTION("Benchmark of kthread_pool against a kthread per task");
+MODULE_VERSION("1.0");
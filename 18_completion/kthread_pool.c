@@ -0,0 +1,272 @@
+/*
+ * kthread_pool.c - a pool of one kthread per CPU, each with its own queue of
+ * tasks, that takes work from the other queues when its own is empty.
+ *
+ * Creating a kthread costs tens of microseconds; queueing on a worker that is
+ * already running costs a lock and a list insertion. A worker runs the newest
+ * task of its own queue first, while its data is still in cache, and steals
+ * the oldest task of a neighbour's. Before going to sleep a worker spins for
+ * spin_ns, so a task queued shortly after the last one starts without a
+ * wakeup.
+ *
+ * Workers are created for the CPUs online at load time. Per-worker counters
+ * are in /sys/kernel/debug/kthread_pool/stats.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/cpu.h> /* for cpus_read_lock() */
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/err.h> /* for IS_ERR() */
+#include <linux/init.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/smp.h>
+#include <linux/spinlock.h>
+
+#include "kthread_pool.h"
+
+static unsigned int spin_ns = 20000;
+module_param(spin_ns, uint, 0644);
+MODULE_PARM_DESC(spin_ns, "How long an idle worker polls for work before sleeping (default: 20000)");
+
+struct kpool_worker
+{
+    spinlock_t lock;
+    struct list_head queue; /* newest at the tail */
+    unsigned int queued;    /* tasks in queue, changed under lock */
+    struct task_struct *task;
+    int cpu;
+    bool idle;
+    unsigned long executed;
+    unsigned long stolen;
+};
+
+static DEFINE_PER_CPU_ALIGNED(struct kpool_worker, kpool_workers);
+
+/* CPUs that have a worker */
+static struct cpumask kpool_cpus;
+
+static struct dentry *kpool_dir;
+
+static struct kpool_work *kpool_pop(struct kpool_worker *w, bool steal)
+{
+    struct kpool_work *work = NULL;
+
+    spin_lock_irq(&w->lock);
+    if (!list_empty(&w->queue))
+    {
+        work = steal ? list_first_entry(&w->queue, struct kpool_work, entry)
+                     : list_last_entry(&w->queue, struct kpool_work, entry);
+        list_del_init(&work->entry);
+        WRITE_ONCE(w->queued, w->queued - 1);
+    }
+    spin_unlock_irq(&w->lock);
+    return work;
+}
+
+/* Tasks queued but not started, in all queues. Only reads the counters, so
+ * idle workers polling it don't take the queues' cache lines away.
+ */
+static unsigned int kpool_queued(void)
+{
+    unsigned int queued = 0;
+    int cpu;
+
+    for_each_cpu(cpu, &kpool_cpus)
+        queued += READ_ONCE(per_cpu_ptr(&kpool_workers, cpu)->queued);
+    return queued;
+}
+
+/* Try the other workers, starting with the next CPU */
+static struct kpool_work *kpool_steal(struct kpool_worker *me)
+{
+    int cpu = me->cpu;
+
+    while ((cpu = cpumask_next(cpu, &kpool_cpus)) != me->cpu)
+    {
+        struct kpool_work *work;
+
+        if (cpu >= nr_cpu_ids)
+        {
+            cpu = -1;
+            continue;
+        }
+        work = kpool_pop(per_cpu_ptr(&kpool_workers, cpu), true);
+        if (work)
+        {
+            me->stolen++;
+            return work;
+        }
+    }
+    return NULL;
+}
+
+/* Wake a sleeping worker, the one whose queue got the work if it sleeps */
+static void kpool_wake(struct kpool_worker *target)
+{
+    int cpu;
+
+    if (READ_ONCE(target->idle))
+    {
+        wake_up_process(target->task);
+        return;
+    }
+    for_each_cpu(cpu, &kpool_cpus)
+    {
+        struct kpool_worker *w = per_cpu_ptr(&kpool_workers, cpu);
+
+        if (READ_ONCE(w->idle))
+        {
+            wake_up_process(w->task);
+            return;
+        }
+    }
+}
+
+void kpool_queue_on(int cpu, struct kpool_work *work)
+{
+    struct kpool_worker *w;
+    unsigned long flags;
+
+    if (cpu < 0 || cpu >= nr_cpu_ids || !cpumask_test_cpu(cpu, &kpool_cpus))
+        cpu = cpumask_first(&kpool_cpus);
+    w = per_cpu_ptr(&kpool_workers, cpu);
+
+    spin_lock_irqsave(&w->lock, flags);
+    list_add_tail(&work->entry, &w->queue);
+    WRITE_ONCE(w->queued, w->queued + 1);
+    spin_unlock_irqrestore(&w->lock, flags);
+
+    /* Pairs with the barrier between setting idle and checking
+     * kpool_queued() in kpool_thread(): either the worker sees the work, or
+     * we see it idle.
+     */
+    smp_mb();
+    kpool_wake(w);
+}
+EXPORT_SYMBOL_GPL(kpool_queue_on);
+
+void kpool_queue(struct kpool_work *work)
+{
+    kpool_queue_on(raw_smp_processor_id(), work);
+}
+EXPORT_SYMBOL_GPL(kpool_queue);
+
+static int kpool_thread(void *arg)
+{
+    struct kpool_worker *me = arg;
+
+    while (!kthread_should_stop())
+    {
+        struct kpool_work *work;
+        u64 deadline;
+
+        work = kpool_pop(me, false);
+        if (!work)
+            work = kpool_steal(me);
+        if (work)
+        {
+            work->func(work);
+            me->executed++;
+            cond_resched();
+            continue;
+        }
+
+        /* Nothing to do: poll for a while, then sleep */
+        deadline = ktime_get_ns() + READ_ONCE(spin_ns);
+        while (!kpool_queued() && !need_resched() && ktime_get_ns() < deadline)
+            cpu_relax();
+        if (kpool_queued())
+            continue;
+
+        set_current_state(TASK_INTERRUPTIBLE);
+        WRITE_ONCE(me->idle, true);
+        smp_mb();
+        if (!kpool_queued() && !kthread_should_stop())
+            schedule();
+        __set_current_state(TASK_RUNNING);
+        WRITE_ONCE(me->idle, false);
+    }
+    return 0;
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+    int cpu;
+
+    seq_printf(m, "queued: %u\n", kpool_queued());
+    for_each_cpu(cpu, &kpool_cpus)
+    {
+        struct kpool_worker *w = per_cpu_ptr(&kpool_workers, cpu);
+
+        seq_printf(m, "cpu %d: executed %lu stolen %lu\n", cpu, READ_ONCE(w->executed),
+                   READ_ONCE(w->stolen));
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+static void kpool_stop(void)
+{
+    int cpu;
+
+    for_each_cpu(cpu, &kpool_cpus)
+        kthread_stop(per_cpu_ptr(&kpool_workers, cpu)->task);
+    cpumask_clear(&kpool_cpus);
+}
+
+static int __init kpool_init(void)
+{
+    int cpu;
+
+    cpus_read_lock();
+    for_each_online_cpu(cpu)
+    {
+        struct kpool_worker *w = per_cpu_ptr(&kpool_workers, cpu);
+
+        spin_lock_init(&w->lock);
+        INIT_LIST_HEAD(&w->queue);
+        w->cpu = cpu;
+        w->task = kthread_create_on_cpu(kpool_thread, w, cpu, "kpool/%u");
+        if (IS_ERR(w->task))
+        {
+            int ret = PTR_ERR(w->task);
+
+            cpus_read_unlock();
+            kpool_stop();
+            return ret;
+        }
+        cpumask_set_cpu(cpu, &kpool_cpus);
+    }
+    cpus_read_unlock();
+
+    for_each_cpu(cpu, &kpool_cpus)
+        wake_up_process(per_cpu_ptr(&kpool_workers, cpu)->task);
+
+    kpool_dir = debugfs_create_dir("kthread_pool", NULL);
+    debugfs_create_file("stats", 0444, kpool_dir, NULL, &stats_fops);
+
+    pr_info("kthread_pool: %u workers\n", cpumask_weight(&kpool_cpus));
+    return 0;
+}
+
+static void __exit kpool_exit(void)
+{
+    debugfs_remove_recursive(kpool_dir);
+    kpool_stop();
+    pr_info("kthread_pool exit\n");
+}
+module_init(kpool_init);
+module_exit(kpool_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("HOUSSEM JARRAY");
+MODULE_DESCRIPTION("Per-CPU kthread pool with work stealing");
+MODULE_VERSION("1.0");
@@ -0,0 +1,37 @@
+/*
+ * kthread_pool.h - the interface of kthread_pool.ko, a pool of one kthread
+ * per CPU that other modules hand short tasks to instead of creating a
+ * kthread for each.
+ */
+
+#ifndef KTHREAD_POOL_H
+#define KTHREAD_POOL_H
+
+#include <linux/list.h>
+
+struct kpool_work;
+typedef void (*kpool_func_t)(struct kpool_work *work);
+
+/* Embed this in the task's own structure and use container_of() in func */
+struct kpool_work
+{
+    struct list_head entry;
+    kpool_func_t func;
+};
+
+static inline void kpool_init_work(struct kpool_work *work, kpool_func_t func)
+{
+    INIT_LIST_HEAD(&work->entry);
+    work->func = func;
+}
+
+/* Queue work on the worker of the current CPU; idle workers steal it from
+ * there if that one is busy. work must not be queued again before func has
+ * started. Safe from any context that may take a spinlock.
+ */
+void kpool_queue(struct kpool_work *work);
+
+/* Queue work on the worker of cpu, or of another CPU if cpu has none */
+void kpool_queue_on(int cpu, struct kpool_work *work);
+
+#endif
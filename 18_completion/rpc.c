@@ -0,0 +1,213 @@
+/*
+ * rpc.c - a char device that runs batches of work items from user space on
+ * the workers of kthread_pool.ko.
+ *
+ * IOCTL_RPC_SUBMIT hands over a whole batch in one system call. The items are
+ * split into tasks of chunk items, queued on the pool, and the submitter
+ * sleeps on a completion group for the batch until the last task is done,
+ * instead of polling for results.
+ *
+ * Usage: insmod kthread_pool.ko && insmod rpc.ko; app/rpc_app
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/err.h> /* for IS_ERR() */
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/init.h>
+#include <linux/ktime.h>
+#include <linux/mm.h> /* for kvcalloc() */
+#include <linux/moduleparam.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+
+#include "completion_group.h"
+#include "kthread_pool.h"
+#include "rpc.h"
+
+#define DEVICE_NAME "rpc"
+
+static unsigned int chunk = 32;
+module_param(chunk, uint, 0644);
+MODULE_PARM_DESC(chunk, "Items per task queued on the pool (default: 32)");
+
+static int major_num;
+static struct class *cls;
+
+struct rpc_task
+{
+    struct kpool_work work;
+    struct rpc_item *items;
+    unsigned int count;
+    struct completion_group *batch;
+};
+
+static void rpc_run_item(struct rpc_item *item)
+{
+    u64 i, end;
+
+    item->status = 0;
+    item->result = 0;
+    switch (item->op)
+    {
+    case RPC_OP_NOP:
+        break;
+    case RPC_OP_SPIN:
+        if (item->arg > RPC_MAX_SPIN_NS)
+            goto invalid;
+        end = ktime_get_ns() + item->arg;
+        while (ktime_get_ns() < end)
+            cpu_relax();
+        item->result = item->arg;
+        break;
+    case RPC_OP_SUM:
+        if (item->arg > RPC_MAX_SUM)
+            goto invalid;
+        for (i = 0; i < item->arg; i++)
+            item->result += i;
+        break;
+    case RPC_OP_HASH:
+        item->result = hash_64(item->arg, 64);
+        break;
+    default:
+        goto invalid;
+    }
+    return;
+
+invalid:
+    item->status = -EINVAL;
+}
+
+static void rpc_run_task(struct kpool_work *work)
+{
+    struct rpc_task *task = container_of(work, struct rpc_task, work);
+    unsigned int i;
+
+    for (i = 0; i < task->count; i++)
+        rpc_run_item(&task->items[i]);
+    completion_group_done(task->batch);
+}
+
+static long rpc_submit(struct rpc_batch __user *ubatch)
+{
+    struct completion_group group;
+    struct rpc_batch batch;
+    struct rpc_item *items;
+    struct rpc_task *tasks;
+    unsigned int per_task = max(READ_ONCE(chunk), 1U);
+    unsigned int ntasks, i;
+    long ret = 0;
+    u64 start;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    if (batch.count == 0 || batch.count > RPC_MAX_BATCH)
+        return -EINVAL;
+
+    ntasks = DIV_ROUND_UP(batch.count, per_task);
+    items = kvcalloc(batch.count, sizeof(*items), GFP_KERNEL);
+    tasks = kvcalloc(ntasks, sizeof(*tasks), GFP_KERNEL);
+    if (!items || !tasks)
+    {
+        ret = -ENOMEM;
+        goto out;
+    }
+    if (copy_from_user(items, u64_to_user_ptr(batch.items), batch.count * sizeof(*items)))
+    {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    completion_group_init(&group, ntasks);
+    start = ktime_get_ns();
+    for (i = 0; i < ntasks; i++)
+    {
+        struct rpc_task *task = &tasks[i];
+
+        kpool_init_work(&task->work, rpc_run_task);
+        task->items = &items[i * per_task];
+        task->count = min(per_task, batch.count - i * per_task);
+        task->batch = &group;
+        kpool_queue(&task->work);
+    }
+    /* Not interruptible: the tasks use items and group until they are done,
+     * and a batch is bounded by RPC_MAX_BATCH items of bounded cost.
+     */
+    completion_group_wait(&group);
+    batch.elapsed_ns = ktime_get_ns() - start;
+
+    if (copy_to_user(u64_to_user_ptr(batch.items), items, batch.count * sizeof(*items)) ||
+        copy_to_user(ubatch, &batch, sizeof(batch)))
+        ret = -EFAULT;
+
+out:
+    kvfree(tasks);
+    kvfree(items);
+    return ret;
+}
+
+static long device_ioctl(struct file *file, unsigned int ioctl_num, unsigned long ioctl_param)
+{
+    switch (ioctl_num)
+    {
+    case IOCTL_RPC_SUBMIT:
+        return rpc_submit((struct rpc_batch __user *)ioctl_param);
+    default:
+        return -ENOTTY;
+    }
+}
+
+static const struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = device_ioctl,
+};
+
+static int __init rpc_init(void)
+{
+    major_num = register_chrdev(0, DEVICE_NAME, &fops);
+    if (major_num < 0)
+    {
+        pr_err("Failed to register character device\n");
+        return major_num;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    cls = class_create(DEVICE_NAME);
+#else
+    cls = class_create(THIS_MODULE, DEVICE_NAME);
+#endif
+    if (IS_ERR(cls))
+    {
+        unregister_chrdev(major_num, DEVICE_NAME);
+        pr_err("Failed to create device class\n");
+        return PTR_ERR(cls);
+    }
+
+    if (IS_ERR(device_create(cls, NULL, MKDEV(major_num, 0), NULL, DEVICE_FILE_NAME)))
+    {
+        class_destroy(cls);
+        unregister_chrdev(major_num, DEVICE_NAME);
+        pr_err("Failed to create device\n");
+        return -ENOMEM;
+    }
+
+    pr_info("Device registered with major number %d\n", major_num);
+    return 0;
+}
+
+static void __exit rpc_exit(void)
+{
+    device_destroy(cls, MKDEV(major_num, 0));
+    class_destroy(cls);
+    unregister_chrdev(major_num, DEVICE_NAME);
+    pr_info("rpc exit\n");
+}
+module_init(rpc_init);
+module_exit(rpc_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("HOUSSEM JARRAY");
+MODULE_DESCRIPTION("Batches of work from user space run on kthread workers");
+MODULE_VERSION("1.0");
@@ -0,0 +1,48 @@
+/*
+ * rpc.h - the ioctl interface of rpc.ko, shared by the module (rpc.c) and
+ * the processes that submit work to it (app/rpc_app.c).
+ */
+
+#ifndef RPC_H
+#define RPC_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* What a work item asks the kernel to do with its arg */
+#define RPC_OP_NOP 0  /* nothing, to measure the overhead */
+#define RPC_OP_SPIN 1 /* keep a CPU busy for arg ns, at most RPC_MAX_SPIN_NS */
+#define RPC_OP_SUM 2  /* result = 0 + 1 + ... + (arg - 1), arg at most RPC_MAX_SUM */
+#define RPC_OP_HASH 3 /* result = hash_64(arg) */
+
+#define RPC_MAX_SPIN_NS 1000000
+#define RPC_MAX_SUM (1 << 20)
+
+struct rpc_item
+{
+    __u32 op;
+    __s32 status; /* out: 0, or -EINVAL for an unknown op or out of range arg */
+    __u64 arg;
+    __u64 result; /* out */
+};
+
+/* Items per batch */
+#define RPC_MAX_BATCH 4096
+
+struct rpc_batch
+{
+    __u64 items;      /* user pointer to count struct rpc_item */
+    __u32 count;
+    __u32 reserved;
+    __u64 elapsed_ns; /* out: from dispatching the first item until the last is done */
+};
+
+/* Run a batch of items on the kernel's worker threads and wait until all are
+ * done. The results are written back into the items.
+ */
+#define IOCTL_RPC_SUBMIT _IOWR('r', 0, struct rpc_batch)
+
+#define DEVICE_FILE_NAME "rpc"
+#define DEVICE_PATH "/dev/rpc"
+
+#endif
@@ -0,0 +1,471 @@
+/*
+ * taskgraph.c - run a graph of tasks where each one starts as soon as the
+ * tasks it depends on have finished, generalizing the crank and flywheel of
+ * completion.c to any number of steps.
+ *
+ * Every node counts the predecessors it still waits for. The last one to
+ * finish queues it on a workqueue, and the last node of all completes the
+ * graph. Synthetic graphs are submitted by writing to debugfs:
+ *
+ *   echo "chain 16 100" > /sys/kernel/debug/taskgraph/run
+ *   echo "fan 64 100" > /sys/kernel/debug/taskgraph/run
+ *   echo "layers 8 32 100" > /sys/kernel/debug/taskgraph/run
+ *   echo "random 1000 2 100 42" > /sys/kernel/debug/taskgraph/run
+ *   cat /sys/kernel/debug/taskgraph/result
+ *
+ * The last number before the seed is how long each task spins, in us, at most
+ * TG_MAX_COST_US. The result compares the makespan to the critical path, the longest chain of
+ * dependent tasks, which no number of CPUs can beat.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/init.h>
+#include <linux/ktime.h>
+#include <linux/math64.h> /* for div64_u64() */
+#include <linux/mm.h>     /* for kvcalloc() */
+#include <linux/mutex.h>
+#include <linux/sched.h> /* for cond_resched() */
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+
+#define TG_MAX_NODES 65536
+#define TG_MAX_EDGES (1 << 22)
+#define TG_SPEC_LENGTH 128
+#define TG_MAX_COST_US 10000
+
+struct tg_graph;
+
+struct tg_node
+{
+    struct work_struct work;
+    struct tg_graph *graph;
+    atomic_t pending;   /* predecessors not finished yet */
+    unsigned int npred;
+    unsigned int first; /* successors are succ[first] .. succ[first + nsucc - 1] */
+    unsigned int nsucc;
+    u64 ready_ns;       /* when the last predecessor finished */
+    u64 start_ns;
+    u64 finish_ns;
+};
+
+struct tg_graph
+{
+    unsigned int nnodes;
+    unsigned int nedges;
+    struct tg_node *nodes;
+    unsigned int *succ;
+    u32 (*edges)[2]; /* while building: from, to */
+    unsigned int max_edges;
+    u64 cost_ns;
+    bool aborted;       /* the writer was killed: skip the work of the rest */
+    atomic_t remaining;
+    struct completion done;
+};
+
+/* What /sys/kernel/debug/taskgraph/result shows, protected by run_lock */
+static struct
+{
+    char spec[TG_SPEC_LENGTH];
+    unsigned int nodes;
+    unsigned int edges;
+    u64 makespan_ns;
+    u64 critical_path_ns;
+    u64 work_ns;
+    u64 dispatch_ns_total;
+    u64 dispatch_ns_max;
+} last;
+
+static DEFINE_MUTEX(run_lock);
+static struct workqueue_struct *tg_wq;
+static struct dentry *tg_dir;
+
+/* Synthetic work: keep the CPU busy for ns, letting others in if needed */
+static void tg_spin(u64 ns)
+{
+    u64 end = ktime_get_ns() + ns;
+
+    while (ktime_get_ns() < end)
+    {
+        cpu_relax();
+        cond_resched();
+    }
+}
+
+static void tg_ready(struct tg_node *node, u64 now)
+{
+    node->ready_ns = now;
+    queue_work(tg_wq, &node->work);
+}
+
+static void tg_node_run(struct work_struct *work)
+{
+    struct tg_node *node = container_of(work, struct tg_node, work);
+    struct tg_graph *g = node->graph;
+    unsigned int i;
+    u64 now;
+
+    node->start_ns = ktime_get_ns();
+    if (!READ_ONCE(g->aborted))
+        tg_spin(g->cost_ns);
+    now = ktime_get_ns();
+    node->finish_ns = now;
+
+    /* The last predecessor to finish dispatches a node */
+    for (i = 0; i < node->nsucc; i++)
+    {
+        struct tg_node *next = &g->nodes[g->succ[node->first + i]];
+
+        if (atomic_dec_and_test(&next->pending))
+            tg_ready(next, now);
+    }
+
+    if (atomic_dec_and_test(&g->remaining))
+        complete(&g->done);
+}
+
+/* Edges always go from a lower to a higher node number, so every graph is
+ * acyclic and node number order is a topological order.
+ */
+static int tg_add_edge(struct tg_graph *g, unsigned int from, unsigned int to)
+{
+    if (g->nedges == g->max_edges)
+        return -E2BIG;
+    g->edges[g->nedges][0] = from;
+    g->edges[g->nedges][1] = to;
+    g->nedges++;
+    return 0;
+}
+
+static int tg_gen_chain(struct tg_graph *g)
+{
+    unsigned int i;
+    int ret = 0;
+
+    for (i = 1; i < g->nnodes && !ret; i++)
+        ret = tg_add_edge(g, i - 1, i);
+    return ret;
+}
+
+/* One node, fanning out to all but the last, which they all fan into */
+static int tg_gen_fan(struct tg_graph *g)
+{
+    unsigned int i, last_node = g->nnodes - 1;
+    int ret = 0;
+
+    if (g->nnodes < 3)
+        return tg_gen_chain(g);
+    for (i = 1; i < last_node && !ret; i++)
+    {
+        ret = tg_add_edge(g, 0, i);
+        if (!ret)
+            ret = tg_add_edge(g, i, last_node);
+    }
+    return ret;
+}
+
+/* depth layers of width nodes, each depending on all of the layer before */
+static int tg_gen_layers(struct tg_graph *g, unsigned int width)
+{
+    unsigned int i, j;
+    int ret = 0;
+
+    for (i = width; i < g->nnodes && !ret; i++)
+        for (j = (i / width - 1) * width; j < i / width * width && !ret; j++)
+            ret = tg_add_edge(g, j, i);
+    return ret;
+}
+
+/* Every pair of nodes gets an edge with probability percent / 100 */
+static int tg_gen_random(struct tg_graph *g, unsigned int percent, u32 seed)
+{
+    u32 x = seed ? seed : 2463534242u;
+    unsigned int i, j;
+    int ret = 0;
+
+    for (j = 1; j < g->nnodes && !ret; j++)
+    {
+        for (i = 0; i < j && !ret; i++)
+        {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            if (x % 100 < percent)
+                ret = tg_add_edge(g, i, j);
+        }
+        cond_resched();
+    }
+    return ret;
+}
+
+/* Turn the edge list into per-node successor ranges */
+static int tg_link(struct tg_graph *g)
+{
+    unsigned int i, pos = 0;
+
+    g->succ = kvcalloc(max(g->nedges, 1U), sizeof(*g->succ), GFP_KERNEL);
+    if (!g->succ)
+        return -ENOMEM;
+
+    for (i = 0; i < g->nedges; i++)
+    {
+        g->nodes[g->edges[i][0]].nsucc++;
+        g->nodes[g->edges[i][1]].npred++;
+    }
+    for (i = 0; i < g->nnodes; i++)
+    {
+        struct tg_node *node = &g->nodes[i];
+
+        node->first = pos;
+        pos += node->nsucc;
+        node->nsucc = 0;
+        node->graph = g;
+        atomic_set(&node->pending, node->npred);
+        INIT_WORK(&node->work, tg_node_run);
+    }
+    for (i = 0; i < g->nedges; i++)
+    {
+        struct tg_node *from = &g->nodes[g->edges[i][0]];
+
+        g->succ[from->first + from->nsucc++] = g->edges[i][1];
+    }
+    return 0;
+}
+
+static void tg_free(struct tg_graph *g)
+{
+    kvfree(g->edges);
+    kvfree(g->succ);
+    kvfree(g->nodes);
+}
+
+/* Build the graph described by spec; see the top of the file */
+static int tg_build(struct tg_graph *g, const char *spec)
+{
+    char kind[16];
+    unsigned int a, b = 0, cost_us = 0, seed = 0;
+    unsigned long long max_edges;
+    int n, ret;
+
+    n = sscanf(spec, "%15s %u %u %u %u", kind, &a, &b, &cost_us, &seed);
+    if (n < 3)
+        return -EINVAL;
+
+    if (!strcmp(kind, "chain") || !strcmp(kind, "fan"))
+    {
+        if (n != 3)
+            return -EINVAL;
+        cost_us = b;
+        g->nnodes = a;
+        max_edges = 2ULL * a;
+    }
+    else if (!strcmp(kind, "layers"))
+    {
+        if (n != 4 || b == 0 || (u64)a * b > TG_MAX_NODES)
+            return -EINVAL;
+        g->nnodes = a * b;
+        max_edges = (unsigned long long)a * b * b;
+    }
+    else if (!strcmp(kind, "random"))
+    {
+        if (n < 4 || b > 100)
+            return -EINVAL;
+        g->nnodes = a;
+        max_edges = (unsigned long long)a * a / 2;
+    }
+    else
+    {
+        return -EINVAL;
+    }
+    if (g->nnodes == 0 || g->nnodes > TG_MAX_NODES || a > TG_MAX_NODES ||
+        cost_us > TG_MAX_COST_US)
+        return -EINVAL;
+
+    g->cost_ns = (u64)cost_us * NSEC_PER_USEC;
+    g->max_edges = min_t(unsigned long long, max_edges, TG_MAX_EDGES);
+    g->nodes = kvcalloc(g->nnodes, sizeof(*g->nodes), GFP_KERNEL);
+    g->edges = kvcalloc(max(g->max_edges, 1U), sizeof(*g->edges), GFP_KERNEL);
+    if (!g->nodes || !g->edges)
+        return -ENOMEM;
+
+    if (!strcmp(kind, "chain"))
+        ret = tg_gen_chain(g);
+    else if (!strcmp(kind, "fan"))
+        ret = tg_gen_fan(g);
+    else if (!strcmp(kind, "layers"))
+        ret = tg_gen_layers(g, b);
+    else
+        ret = tg_gen_random(g, b, seed);
+    if (ret)
+        return ret;
+
+    ret = tg_link(g);
+    kvfree(g->edges);
+    g->edges = NULL;
+    return ret;
+}
+
+/* Dispatch the nodes without predecessors and wait for the whole graph.
+ * Returns -EINTR if the writer was killed before it finished.
+ */
+static int tg_run(struct tg_graph *g, u64 *start)
+{
+    unsigned int i;
+
+    init_completion(&g->done);
+    atomic_set(&g->remaining, g->nnodes);
+
+    *start = ktime_get_ns();
+    for (i = 0; i < g->nnodes; i++)
+        if (g->nodes[i].npred == 0)
+            tg_ready(&g->nodes[i], *start);
+
+    if (!wait_for_completion_killable(&g->done))
+        return 0;
+
+    /* The nodes use the graph until the last one is done, so let the rest
+     * run through without their work and wait for that.
+     */
+    WRITE_ONCE(g->aborted, true);
+    wait_for_completion(&g->done);
+    return -EINTR;
+}
+
+/* Called with run_lock held */
+static void tg_report(struct tg_graph *g, u64 start)
+{
+    u64 *path, end = start;
+    unsigned int i, j;
+
+    last.nodes = g->nnodes;
+    last.edges = g->nedges;
+    last.work_ns = 0;
+    last.dispatch_ns_total = 0;
+    last.dispatch_ns_max = 0;
+    last.critical_path_ns = 0;
+
+    /* Longest chain of measured task times ending at each node, using the
+     * node number order as topological order.
+     */
+    path = kvcalloc(g->nnodes, sizeof(*path), GFP_KERNEL);
+    for (i = 0; i < g->nnodes; i++)
+    {
+        struct tg_node *node = &g->nodes[i];
+        u64 took = node->finish_ns - node->start_ns;
+        u64 dispatch = node->start_ns - node->ready_ns;
+
+        end = max(end, node->finish_ns);
+        last.work_ns += took;
+        last.dispatch_ns_total += dispatch;
+        last.dispatch_ns_max = max(last.dispatch_ns_max, dispatch);
+        if (!path)
+            continue;
+        path[i] += took;
+        last.critical_path_ns = max(last.critical_path_ns, path[i]);
+        for (j = 0; j < node->nsucc; j++)
+        {
+            unsigned int next = g->succ[node->first + j];
+
+            path[next] = max(path[next], path[i]);
+        }
+    }
+    kvfree(path);
+    last.makespan_ns = end - start;
+}
+
+static ssize_t run_write(struct file *file, const char __user *buffer, size_t length, loff_t *offset)
+{
+    struct tg_graph g = {0};
+    char spec[TG_SPEC_LENGTH];
+    size_t len = min_t(size_t, length, sizeof(spec) - 1);
+    u64 start;
+    int ret;
+
+    if (copy_from_user(spec, buffer, len))
+        return -EFAULT;
+    spec[len] = '\0';
+
+    ret = tg_build(&g, spec);
+    if (ret)
+    {
+        tg_free(&g);
+        return ret;
+    }
+
+    if (mutex_lock_killable(&run_lock))
+    {
+        tg_free(&g);
+        return -EINTR;
+    }
+    ret = tg_run(&g, &start);
+    if (!ret)
+    {
+        strscpy(last.spec, strim(spec), sizeof(last.spec));
+        tg_report(&g, start);
+    }
+    mutex_unlock(&run_lock);
+
+    tg_free(&g);
+    return ret ? ret : length;
+}
+
+static const struct file_operations run_fops = {
+    .owner = THIS_MODULE,
+    .write = run_write,
+};
+
+static int result_show(struct seq_file *m, void *v)
+{
+    mutex_lock(&run_lock);
+    if (last.nodes)
+    {
+        seq_printf(m, "graph: %s\n", last.spec);
+        seq_printf(m, "nodes: %u\n", last.nodes);
+        seq_printf(m, "edges: %u\n", last.edges);
+        seq_printf(m, "makespan_ns: %llu\n", last.makespan_ns);
+        seq_printf(m, "critical_path_ns: %llu\n", last.critical_path_ns);
+        seq_printf(m, "work_ns: %llu\n", last.work_ns);
+        seq_printf(m, "parallelism_x100: %llu\n",
+                   div64_u64(last.work_ns * 100, max(last.makespan_ns, 1ULL)));
+        seq_printf(m, "dispatch_ns_avg: %llu\n", div64_u64(last.dispatch_ns_total, last.nodes));
+        seq_printf(m, "dispatch_ns_max: %llu\n", last.dispatch_ns_max);
+    }
+    mutex_unlock(&run_lock);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(result);
+
+static int __init taskgraph_init(void)
+{
+    /* Unbound, so ready nodes spread over all CPUs */
+    tg_wq = alloc_workqueue("taskgraph", WQ_UNBOUND, 0);
+    if (!tg_wq)
+        return -ENOMEM;
+
+    tg_dir = debugfs_create_dir("taskgraph", NULL);
+    debugfs_create_file("run", 0200, tg_dir, NULL, &run_fops);
+    debugfs_create_file("result", 0444, tg_dir, NULL, &result_fops);
+
+    pr_info("taskgraph loaded\n");
+    return 0;
+}
+
+static void __exit taskgraph_exit(void)
+{
+    debugfs_remove_recursive(tg_dir);
+    destroy_workqueue(tg_wq);
+    pr_info("taskgraph exit\n");
+}
+module_init(taskgraph_init);
+module_exit(taskgraph_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("HOUSSEM JARRAY");
+MODULE_DESCRIPTION("Dependency graph of tasks run on a workqueue");
+MODULE_VERSION("1.0");